@@ -0,0 +1,221 @@
+/*
+ * Compares the table-driven escape encoder against the printf based
+ * path it replaced, on a synthetic stream of coloured text: every op is
+ * a cursor jump, an attribute change and a short run of characters.
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "encode.h"
+
+#define OPS		200000
+#define ROUNDS		10
+#define TEXT		"make: *** "
+
+typedef struct {
+	int row, col;
+	Attr attr;
+} Op;
+
+static void ref_printf(OutBuf *out, const char *fmt, ...);
+
+static int ref_color(char *p, int color, int base);
+
+static int ref_params(char *p, Attr from, Attr to);
+
+static void ref_sgr(OutBuf *out, Attr from, Attr to);
+
+static void run_ref(OutBuf *out, const Op *ops, int n);
+
+static void run_enc(OutBuf *out, const Op *ops, int n);
+
+static double now(void);
+
+static void
+ref_printf(OutBuf *out, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if(n <= 0) return;
+
+	out_reserve(out, n + 1);
+	va_start(ap, fmt);
+	vsnprintf(out->data + out->len, n + 1, fmt, ap);
+	va_end(ap);
+	out->len += n;
+}
+
+static int
+ref_color(char *p, int color, int base)
+{
+	if(color >= COLOR_RGB) {
+		return sprintf(p, ";%d;2;%d;%d;%d", base + 8, color >> 16 & 0xff, color >> 8 & 0xff, color & 0xff);
+	} else if(color == -1) {
+		return sprintf(p, ";%d", base + 9);
+	} else if(color < 8) {
+		return sprintf(p, ";%d", base + color);
+	} else if(color < 16) {
+		return sprintf(p, ";%d", base + 60 + color - 8);
+	}
+	return sprintf(p, ";%d;5;%d", base + 8, color);
+}
+
+static int
+ref_params(char *p, Attr from, Attr to)
+{
+	static const struct {
+		int flag, on, off;
+	} codes[] = {
+		{ ATTR_BOLD, 1, 22 }, { ATTR_FAINT, 2, 22 }, { ATTR_ITALIC, 3, 23 },
+		{ ATTR_UNDERLINE, 4, 24 }, { ATTR_BLINK, 5, 25 }, { ATTR_REVERSE, 7, 27 },
+		{ ATTR_CONCEAL, 8, 28 }, { ATTR_STRIKE, 9, 29 },
+	};
+	int i, len, removed, added;
+
+	len = 0;
+	removed = from.attr & ~to.attr;
+	added = to.attr & ~from.attr;
+	if(removed & (ATTR_BOLD | ATTR_FAINT)) {
+		added |= to.attr & (ATTR_BOLD | ATTR_FAINT);
+		removed |= ATTR_BOLD;
+		removed &= ~ATTR_FAINT;
+	}
+	for(i = 0; i < sizeof(codes) / sizeof(codes[0]); ++i) {
+		if(removed & codes[i].flag) {
+			len += sprintf(p + len, ";%d", codes[i].off);
+		}
+		if(added & codes[i].flag) {
+			len += sprintf(p + len, ";%d", codes[i].on);
+		}
+	}
+	if(from.fg != to.fg) {
+		len += ref_color(p + len, to.fg, 30);
+	}
+	if(from.bg != to.bg) {
+		len += ref_color(p + len, to.bg, 40);
+	}
+	return len;
+}
+
+static void
+ref_sgr(OutBuf *out, Attr from, Attr to)
+{
+	static const Attr plain = { -1, -1, 0 };
+	char delta[128], reset[128];
+	int dlen, rlen;
+
+	reset[0] = '0';
+	rlen = ref_params(reset + 1, plain, to);
+	rlen = rlen ? rlen + 1 : 0;
+	dlen = -1;
+	if(from.attr != -1) {
+		dlen = ref_params(delta, from, to) - 1;
+	}
+
+	ref_printf(out, ANSIESC);
+	if(dlen != -1 && dlen < rlen) {
+		ref_printf(out, "%.*s", dlen, delta + 1);
+	} else {
+		ref_printf(out, "%.*s", rlen, reset);
+	}
+	ref_printf(out, "m");
+}
+
+static void
+run_ref(OutBuf *out, const Op *ops, int n)
+{
+	Attr cur = { -2, -2, -1 };
+	int i;
+
+	for(i = 0; i < n; ++i) {
+		ref_printf(out, ANSIESC "%d;%dH", ops[i].row, ops[i].col);
+		if(memcmp(&cur, &ops[i].attr, sizeof(Attr))) {
+			ref_sgr(out, cur, ops[i].attr);
+			cur = ops[i].attr;
+		}
+		ref_printf(out, "%s", TEXT);
+	}
+}
+
+static void
+run_enc(OutBuf *out, const Op *ops, int n)
+{
+	Attr cur = { -2, -2, -1 };
+	int i;
+
+	for(i = 0; i < n; ++i) {
+		enc_csi2(out, ops[i].row, ops[i].col, 'H');
+		if(memcmp(&cur, &ops[i].attr, sizeof(Attr))) {
+			enc_sgr(out, cur, ops[i].attr);
+			cur = ops[i].attr;
+		}
+		out_str(out, TEXT);
+	}
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(void)
+{
+	OutBuf ref = { NULL, 0, 0 }, enc = { NULL, 0, 0 };
+	Op *ops;
+	double t, tref, tenc;
+	int i, r;
+
+	enc_init();
+	srand(1);
+	ops = malloc(OPS * sizeof(Op));
+	for(i = 0; i < OPS; ++i) {
+		ops[i].row = 1 + rand() % 60;
+		ops[i].col = 1 + rand() % 200;
+		ops[i].attr.attr = (rand() % 4 == 0) ? (1 << (rand() % 8)) : 0;
+		ops[i].attr.fg = (rand() % 3 == 0) ? -1 : rand() % 256;
+		if(rand() % 8 == 0) {
+			ops[i].attr.fg = COLOR_RGB | (rand() & 0xffffff);
+		}
+		ops[i].attr.bg = (rand() % 4 == 0) ? rand() % 16 : -1;
+	}
+
+	tref = tenc = 1e9;
+	for(r = 0; r < ROUNDS; ++r) {
+		ref.len = 0;
+		t = now();
+		run_ref(&ref, ops, OPS);
+		t = now() - t;
+		tref = (t < tref) ? t : tref;
+
+		enc.len = 0;
+		t = now();
+		run_enc(&enc, ops, OPS);
+		t = now() - t;
+		tenc = (t < tenc) ? t : tenc;
+	}
+
+	if(ref.len != enc.len || memcmp(ref.data, enc.data, ref.len)) {
+		fprintf(stderr, "encoder output differs from printf path\n");
+		return 1;
+	}
+	printf("%d ops, %zu bytes per round\n", OPS, enc.len);
+	printf("printf:  %7.1f ns/op %8.1f MB/s\n", tref * 1e9 / OPS, enc.len / tref / 1e6);
+	printf("encoder: %7.1f ns/op %8.1f MB/s (%.1fx)\n", tenc * 1e9 / OPS, enc.len / tenc / 1e6, tref / tenc);
+
+	free(ops);
+	free(ref.data);
+	free(enc.data);
+	return 0;
+}
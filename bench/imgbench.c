@@ -0,0 +1,162 @@
+/*
+ * Times scaling the decoy images down to common terminal sizes and
+ * encoding them as sixels, on one thread and on one per core, next to
+ * the plain area average the scaler replaced. Images are the repo's own
+ * unless given as arguments.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "img.h"
+
+#define ROUNDS		5
+
+static const struct {
+	const char *name;
+	int w, h;
+} sizes[] = {
+	{ "80x24 9x18", 720, 432 },
+	{ "120x36 9x18", 1080, 648 },
+	{ "160x45 10x20", 1600, 900 },
+	{ "240x67 8x16", 1920, 1072 },
+};
+
+static const char *images[] = { "bscode.png", "meme.png", "thematrix.png" };
+
+static double now(void);
+
+static void ref_scale(Image *dst, const Image *src, int w, int h);
+
+static double time_scale(const Image *img, int w, int h, int ref);
+
+static double time_sixel(const Image *img, size_t *len);
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void
+ref_scale(Image *dst, const Image *src, int w, int h)
+{
+	const unsigned char *p;
+	unsigned char *q;
+	unsigned int sum[3];
+	int x, y, sx, sy, x0, x1, y0, y1, n;
+
+	/* Whole source pixels averaged, one thread, no vectors. */
+	dst->w = w;
+	dst->h = h;
+	if(!(q = dst->rgb = malloc((size_t)w * h * 3))) {
+		perror("malloc");
+		exit(1);
+	}
+	for(y = 0; y < h; ++y) {
+		y0 = (long long)y * src->h / h;
+		y1 = (long long)(y + 1) * src->h / h;
+		y1 = (y1 > y0) ? y1 : y0 + 1;
+		for(x = 0; x < w; ++x) {
+			x0 = (long long)x * src->w / w;
+			x1 = (long long)(x + 1) * src->w / w;
+			x1 = (x1 > x0) ? x1 : x0 + 1;
+			sum[0] = sum[1] = sum[2] = 0;
+			for(sy = y0; sy < y1; ++sy) {
+				p = src->rgb + ((size_t)sy * src->w + x0) * 3;
+				for(sx = x0; sx < x1; ++sx, p += 3) {
+					sum[0] += p[0];
+					sum[1] += p[1];
+					sum[2] += p[2];
+				}
+			}
+			n = (x1 - x0) * (y1 - y0);
+			*q++ = (sum[0] + n / 2) / n;
+			*q++ = (sum[1] + n / 2) / n;
+			*q++ = (sum[2] + n / 2) / n;
+		}
+	}
+}
+
+static double
+time_scale(const Image *img, int w, int h, int ref)
+{
+	Image dst;
+	double best, t;
+	int i;
+
+	best = 1e9;
+	for(i = 0; i < ROUNDS; ++i) {
+		t = now();
+		if(ref) {
+			ref_scale(&dst, img, w, h);
+		} else if(img_scale(&dst, img, w, h)) {
+			exit(1);
+		}
+		t = now() - t;
+		best = (t < best) ? t : best;
+		img_free(&dst);
+	}
+	return best;
+}
+
+static double
+time_sixel(const Image *img, size_t *len)
+{
+	OutBuf out;
+	double best, t;
+	int i;
+
+	best = 1e9;
+	memset(&out, 0, sizeof(out));
+	for(i = 0; i < ROUNDS; ++i) {
+		out.len = 0;
+		t = now();
+		img_sixel(&out, img, img->w, img->h);
+		t = now() - t;
+		best = (t < best) ? t : best;
+	}
+	*len = out.len;
+	free(out.data);
+	return best;
+}
+
+int
+main(int argc, char *argv[])
+{
+	Image img, dst;
+	size_t len;
+	double ref, one, all, six1, sixn;
+	long cores;
+	int i, j, n;
+
+	cores = sysconf(_SC_NPROCESSORS_ONLN);
+	n = (argc > 1) ? argc - 1 : (int)(sizeof(images) / sizeof(images[0]));
+	printf("%ld cores; ms, best of %d\n", cores, ROUNDS);
+	printf("%-14s %-13s %8s %8s %8s %9s %9s %9s\n", "image", "terminal", "ref",
+	       "scale 1", "scale N", "sixel 1", "sixel N", "sixel kB");
+	for(i = 0; i < n; ++i) {
+		if(img_load(&img, (argc > 1) ? argv[i + 1] : images[i])) return 1;
+		for(j = 0; j < (int)(sizeof(sizes) / sizeof(sizes[0])); ++j) {
+			ref = time_scale(&img, sizes[j].w, sizes[j].h, 1);
+			img_threads(1);
+			one = time_scale(&img, sizes[j].w, sizes[j].h, 0);
+			if(img_scale(&dst, &img, sizes[j].w, sizes[j].h)) return 1;
+			six1 = time_sixel(&dst, &len);
+			img_threads(0);
+			all = time_scale(&img, sizes[j].w, sizes[j].h, 0);
+			sixn = time_sixel(&dst, &len);
+			printf("%-14s %-13s %8.2f %8.2f %8.2f %9.2f %9.2f %9zu\n",
+			       (argc > 1) ? argv[i + 1] : images[i], sizes[j].name,
+			       ref, one, all, six1, sixn, len / 1024);
+			img_free(&dst);
+		}
+		img_free(&img);
+	}
+	return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * Parser throughput over recorded output streams, fed in the chunks the
+ * pty loop reads. Each stream is timed parsing alone and parsing with a
+ * render after every chunk. Record streams with e.g.
+ *
+ *	script -q -c 'ls --color=always -R /usr' ls.rec
+ *
+ * and pass them as arguments. Without any, a synthetic stream of text,
+ * UTF-8, SGR, cursor motion, OSC titles and DCS payloads is used.
+ */
+#define PTY_SHELL_NO_MAIN
+#include "pty-shell.c"
+
+#include <time.h>
+
+#define ROUNDS		5
+#define SYNTH_SIZE	(8 << 20)
+
+static char *read_file(const char *path, size_t *len);
+
+static char *synth_stream(size_t *len);
+
+static double now(void);
+
+static double run(PTYState *state, const char *buf, size_t len, int rendering);
+
+static void bench(const char *name, const char *buf, size_t len);
+
+static char *
+read_file(const char *path, size_t *len)
+{
+	FILE *f;
+	char *buf;
+	size_t size, r;
+
+	if(!(f = fopen(path, "rb"))) {
+		perror(path);
+		return NULL;
+	}
+	size = 1 << 20;
+	buf = malloc(size);
+	*len = 0;
+	while(buf && (r = fread(buf + *len, 1, size - *len, f)) > 0) {
+		*len += r;
+		if(*len == size) {
+			size *= 2;
+			buf = realloc(buf, size);
+		}
+	}
+	fclose(f);
+	return buf;
+}
+
+static char *
+synth_stream(size_t *len)
+{
+	static const char *pieces[] = {
+		"drwxr-xr-x  2 root root  4096 Jan  1 00:00 \033[01;34mbin\033[0m\r\n",
+		"-rw-r--r--  1 root root 12873 Jan  1 00:00 Makefile\r\n",
+		"\033[38;5;208mwarning:\033[0m unused variable \033[1m'x'\033[22m\r\n",
+		"\033[38:2::40:80:120mdirect\033[39m \033[4:3mcurly\033[4:0m\r\n",
+		"\033]0;user@host: ~/src\007",
+		"\033]8;;file:///tmp\033\\link\033]8;;\033\\\r\n",
+		"\033P1$r0;1m\033\\",
+		"\033[24;1H\033[K-- INSERT --\033[3;5H",
+		"\033[?25l\033[1;24r\033[24H\n\033[?25h",
+		"\tcol\tumns\tof\ttext\r\n",
+		"\033[>4;2m\033(B\033[m",
+		"\342\224\214\342\224\200\342\224\200\342\224\220 CPU \342\226\210\342\226\210\342\226\221 12%\r\n",
+		"caf\303\251 \344\270\255\346\226\207 \360\237\231\202\r\n",
+	};
+	char *buf;
+	size_t n, k;
+	int i;
+
+	buf = malloc(SYNTH_SIZE);
+	srand(1);
+	for(n = 0; buf; n += k) {
+		i = rand() % (sizeof(pieces) / sizeof(pieces[0]));
+		k = strlen(pieces[i]);
+		if(n + k > SYNTH_SIZE) break;
+		memcpy(buf + n, pieces[i], k);
+	}
+	*len = n;
+	return buf;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+run(PTYState *state, const char *buf, size_t len, int rendering)
+{
+	size_t off, n;
+	double t;
+
+	t = now();
+	for(off = 0; off < len; off += n) {
+		n = (len - off < BUFFER_SIZE) ? len - off : BUFFER_SIZE;
+		vt_feed(state, buf + off, n);
+		if(rendering) {
+			render(state);
+		}
+		state->out.len = 0;
+	}
+	return now() - t;
+}
+
+static void
+bench(const char *name, const char *buf, size_t len)
+{
+	PTYState state;
+	double t, tparse, trender;
+	int r;
+
+	init_state(&state);
+	state.x = state.y = 0;
+	state.w = 80;
+	state.h = 24;
+	if(init_screen(&state)) {
+		exit(1);
+	}
+
+	tparse = trender = 1e9;
+	for(r = 0; r < ROUNDS; ++r) {
+		t = run(&state, buf, len, 0);
+		tparse = (t < tparse) ? t : tparse;
+		t = run(&state, buf, len, 1);
+		trender = (t < trender) ? t : trender;
+	}
+	printf("%-20s %9zu bytes  parse %8.1f MB/s  parse+render %8.1f MB/s\n",
+	       name, len, len / tparse / 1e6, len / trender / 1e6);
+
+	grid_free(&state.buffer);
+	grid_free(&state.shown);
+	grid_free(&state.alt);
+	attr_table_free(&state.attrs);
+	free(state.out.data);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *buf;
+	size_t len;
+	int i;
+
+	enc_init();
+	vt_init();
+	if(argc < 2) {
+		if(!(buf = synth_stream(&len))) return 1;
+		bench("synthetic", buf, len);
+		free(buf);
+		return 0;
+	}
+	for(i = 1; i < argc; ++i) {
+		if(!(buf = read_file(argv[i], &len))) return 1;
+		bench(argv[i], buf, len);
+		free(buf);
+	}
+	return 0;
+}
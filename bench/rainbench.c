@@ -0,0 +1,245 @@
+/*
+ * Headless digital rain, as pty-shell -D draws it around a region, on a
+ * 200x60 terminal replaced by a counter. Ticks are run back to back and
+ * each is presented as a frame, so the time they take against the time
+ * they stand for is the share of a core the rain costs at that rate.
+ *
+ * In the full width case a child writes lines between the ticks, which
+ * goes out forwarded while in lockstep. The output is followed by a
+ * model of the terminal's cursor, which must end each frame where the
+ * child's is, or forwarded text would land in the rain.
+ */
+#define PTY_SHELL_NO_MAIN
+#include "pty-shell.c"
+
+#include <sys/resource.h>
+
+#define COLS		200
+#define ROWS		60
+#define SECONDS		20	/* Of rain at each rate. */
+
+typedef struct {
+	int row, col;
+	int top, bottom;
+	int pending;			/* Wrap pending at the right edge. */
+} Cursor;
+
+static double cpu(void);
+
+static void cursor_print(Cursor *c);
+
+static void cursor_follow(Cursor *c, const char *s, size_t n);
+
+static void run(int rate, int full);
+
+static double
+cpu(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	       ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static void
+cursor_print(Cursor *c)
+{
+	if(c->pending) {
+		c->col = 0;
+		c->row += (c->row != c->bottom && c->row < ROWS - 1);
+		c->pending = 0;
+	}
+	if(c->col == COLS - 1) {
+		c->pending = 1;
+	} else {
+		++c->col;
+	}
+}
+
+static void
+cursor_follow(Cursor *c, const char *s, size_t n)
+{
+	const char *end = s + n;
+	int p[2], np, i;
+	char final;
+
+	/* Only what pty-shell sends: text, CR, LF, BS and CSI sequences. */
+	while(s < end) {
+		if(*s == '\033' && s + 1 < end && s[1] == '[') {
+			p[0] = p[1] = np = 0;
+			for(s += 2; s < end && ((*s >= '0' && *s <= '9') || *s == ';' || *s == '?'); ++s) {
+				if(*s == ';') {
+					np = 1;
+				} else if(*s != '?') {
+					p[np] = p[np] * 10 + *s - '0';
+				}
+			}
+			if(s == end) break;
+			final = *s++;
+			if(final == 'm') continue;
+			i = p[0] ? p[0] : 1;
+			switch(final) {
+			case 'H':
+				c->row = i - 1;
+				c->col = (p[1] ? p[1] : 1) - 1;
+				break;
+			case 'A':
+				c->row -= i;
+				c->row = (c->row < c->top) ? c->top : c->row;
+				break;
+			case 'B':
+				c->row += i;
+				c->row = (c->row > c->bottom) ? c->bottom : c->row;
+				break;
+			case 'C':
+				c->col = (c->col + i < COLS) ? c->col + i : COLS - 1;
+				break;
+			case 'D':
+				c->col = (c->col - i > 0) ? c->col - i : 0;
+				break;
+			case 'G':
+				c->col = i - 1;
+				break;
+			case 'b':
+				/* REP keeps a pending wrap, and may wrap itself. */
+				while(i--) {
+					cursor_print(c);
+				}
+				continue;
+			case 'r':
+				c->top = i - 1;
+				c->bottom = (p[1] ? p[1] : ROWS) - 1;
+				/* FALLTHROUGH */
+			case 's':
+				c->row = c->col = 0;
+				break;
+			case 'L': /* FALLTHROUGH */
+			case 'M':
+				c->col = 0;
+				break;
+			}
+			c->pending = 0;
+		} else if(*s == '\r') {
+			c->col = c->pending = 0;
+			++s;
+		} else if(*s == '\n') {
+			c->row += (c->row != c->bottom && c->row < ROWS - 1);
+			c->pending = 0;
+			++s;
+		} else if(*s == '\b') {
+			c->col -= (c->col > 0);
+			c->pending = 0;
+			++s;
+		} else {
+			if((*s & 0xc0) != 0x80 && (unsigned char)*s >= 0x20) {
+				cursor_print(c);
+			}
+			++s;
+		}
+	}
+}
+
+static void
+run(int rate, int full)
+{
+	PTYState state;
+	Cursor c;
+	unsigned long long out, cells, locked, astray;
+	Cell *line, *shown;
+	char text[COLS + 8];
+	double t;
+	int i, row, col, ticks, n;
+
+	init_state(&state);
+	state.cols = state.clip_cols = COLS;
+	state.rows = state.clip_rows = ROWS;
+	state.x = full ? 0 : COLS / 4;
+	state.y = ROWS / 5;
+	state.w = full ? COLS : COLS / 2;
+	state.h = ROWS * 3 / 5;
+	state.right_edge = state.full_width = full;
+	state.fps = 0;
+	state.rain = rate;
+	if(init_screen(&state)) {
+		exit(1);
+	}
+
+	/* The first frame sets the margins as main() does, and blanks the
+	 * terminal around the region. The rain takes a screen's height to
+	 * fill it. */
+	memset(&c, 0, sizeof(c));
+	c.bottom = ROWS - 1;
+	out_str(&state.out, ANSIESC "?69h");
+	enc_csi2(&state.out, state.x + 1, state.x + state.w, 's');
+	enc_csi2(&state.out, state.y + 1, state.y + state.h, 'r');
+	set_dirty_rows(&state, 0, state.h - 1);
+	for(i = 0; i < ROWS * 3; ++i) {
+		rain_tick(&state);
+		present(&state);
+		cursor_follow(&c, state.out.data, state.out.len);
+		state.out.len = state.frame_mark = 0;
+	}
+
+	out = cells = locked = astray = 0;
+	ticks = rate * SECONDS;
+	t = cpu();
+	for(i = 0; i < ticks; ++i) {
+		if(full) {
+			/* A line of varying length, now and then one that wraps. */
+			n = snprintf(text, sizeof(text), "%d %.*s\r\n", i, (i * 37) % (COLS + 20) % COLS,
+			             "The quick brown fox jumps over the lazy dog. "
+			             "The quick brown fox jumps over the lazy dog. "
+			             "The quick brown fox jumps over the lazy dog. "
+			             "The quick brown fox jumps over the lazy dog. "
+			             "The quick brown fox jumps over the lazy dog.");
+			vt_feed(&state, text, n);
+		}
+		rain_tick(&state);
+		for(row = 0; row < ROWS; ++row) {
+			line = grid_row(&state.back, row);
+			shown = grid_row(&state.back_shown, row);
+			for(col = state.back.dirtystart[row]; col != -1 && col <= state.back.dirtyend[row]; ++col) {
+				cells += !cell_equal(line + col, shown + col);
+			}
+		}
+		present(&state);
+		out += state.out.len;
+		if(full) {
+			cursor_follow(&c, state.out.data, state.out.len);
+			locked += state.lockstep;
+			astray += state.lockstep && (c.row != state.y + state.vrow || c.col != state.x + state.vcol);
+		}
+		state.out.len = state.frame_mark = 0;
+	}
+	t = cpu() - t;
+	printf("%3d fps %-5s %8.1f kB/s %6.0f B/frame %5.0f cells/frame %6.1f us/frame %5.2f%% cpu",
+	       rate, full ? "full" : "inset", out / 1e3 / SECONDS, (double)out / ticks, (double)cells / ticks,
+	       t * 1e6 / ticks, t * 100 / SECONDS);
+	if(full) {
+		printf(", %llu frames in lockstep, %llu with the cursor astray", locked, astray);
+	}
+	printf("\n");
+
+	grid_free(&state.buffer);
+	grid_free(&state.shown);
+	grid_free(&state.alt);
+	grid_free(&state.back);
+	grid_free(&state.back_shown);
+	free(state.drops);
+	attr_table_free(&state.attrs);
+	free(state.out.data);
+}
+
+int
+main(void)
+{
+	enc_init();
+	vt_init();
+	printf("digital rain on %dx%d around a region %d rows high\n", COLS, ROWS, ROWS * 3 / 5);
+	run(30, 0);
+	run(60, 0);
+	run(30, 1);
+	run(60, 1);
+	return 0;
+}
@@ -0,0 +1,354 @@
+/*
+ * Headless replay of terminal output through the parser and renderer,
+ * with the outer terminal replaced by a counter. Input arrives in the
+ * reads the pty loop makes and a frame is presented after each read
+ * budget, as under a child that writes faster than the terminal draws.
+ * Each stream is replayed into an inset region and a full width one.
+ *
+ * Without arguments, generated stand-ins for a large cat, ls --color
+ * -R, vim scrolling, htop frames and a yes flood are used. Recordings
+ * made with e.g.
+ *
+ *	script -q -c 'htop' htop.rec
+ *
+ * or pty-shell -r htop.cast can be given as arguments instead, the
+ * output of a .cast without its timing.
+ */
+#define PTY_SHELL_NO_MAIN
+#include "pty-shell.c"
+
+#include <sys/resource.h>
+
+#define COLS		80
+#define ROWS		24
+#define STREAM_SIZE	(8 << 20)
+#define ROUNDS		3
+#define SLACK		65536	/* Room for the piece that ends a stream. */
+
+typedef struct {
+	double seconds;
+	unsigned long long in, out, reads, writes;
+} Result;
+
+static char *read_file(const char *path, size_t *len);
+
+static char *read_cast(const char *path, size_t *len);
+
+static void put(char **p, const char *fmt, ...);
+
+static char *gen_cat(size_t *len);
+
+static char *gen_ls(size_t *len);
+
+static char *gen_vim(size_t *len);
+
+static char *gen_htop(size_t *len);
+
+static char *gen_yes(size_t *len);
+
+static double now(void);
+
+static void sink(PTYState *state, Result *r);
+
+static Result replay(const char *buf, size_t len, int full);
+
+static void report(const char *name, const char *buf, size_t len);
+
+static const char *words[] = {
+	"static", "int", "return", "state", "buffer", "render", "if(", "for(",
+	"out", "->", "0;", "}", "{", "char", "size_t", "the", "a", "cell",
+};
+
+static char *
+read_file(const char *path, size_t *len)
+{
+	FILE *f;
+	char *buf;
+	size_t size, r;
+
+	if(!(f = fopen(path, "rb"))) {
+		perror(path);
+		return NULL;
+	}
+	size = 1 << 20;
+	buf = malloc(size);
+	*len = 0;
+	while(buf && (r = fread(buf + *len, 1, size - *len, f)) > 0) {
+		*len += r;
+		if(*len == size) {
+			size *= 2;
+			buf = realloc(buf, size);
+		}
+	}
+	fclose(f);
+	return buf;
+}
+
+static char *
+read_cast(const char *path, size_t *len)
+{
+	Cast cast;
+	char *buf, type;
+	size_t n;
+	double t;
+
+	/* The output is never longer than the file that escapes it. */
+	if(cast_open(&cast, path)) return NULL;
+	if((buf = malloc(cast.size))) {
+		*len = 0;
+		while(cast_next(&cast, &t, &type, &n)) {
+			if(type == 'o') {
+				memcpy(buf + *len, cast.buf, n);
+				*len += n;
+			}
+		}
+	}
+	cast_close(&cast);
+	return buf;
+}
+
+static void
+put(char **p, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	*p += vsprintf(*p, fmt, ap);
+	va_end(ap);
+}
+
+static char *
+gen_cat(size_t *len)
+{
+	char *buf, *p;
+	int i, n;
+
+	/* Source code: lines of words, indented with tabs. */
+	if(!(p = buf = malloc(STREAM_SIZE + SLACK))) return NULL;
+	while(p - buf < STREAM_SIZE) {
+		n = rand() % 3;
+		for(i = 0; i < n; ++i) {
+			*p++ = '\t';
+		}
+		for(n = rand() % 10; n >= 0; --n) {
+			put(&p, "%s ", words[rand() % (sizeof(words) / sizeof(words[0]))]);
+		}
+		put(&p, "\r\n");
+	}
+	*len = p - buf;
+	return buf;
+}
+
+static char *
+gen_ls(size_t *len)
+{
+	static const char *colors[] = { "01;34", "01;32", "01;36", "00", "01;31" };
+	char *buf, *p;
+	int col, w;
+
+	/* Directory headers and names in coloured columns. */
+	if(!(p = buf = malloc(STREAM_SIZE + SLACK))) return NULL;
+	while(p - buf < STREAM_SIZE) {
+		put(&p, "\r\n/usr/share/doc/pkg%d:\r\n", rand() % 1000);
+		for(col = rand() % 40; col >= 0; --col) {
+			w = 4 + rand() % 12;
+			put(&p, "\033[0m\033[%sm%.*s\033[0m%*s", colors[rand() % 5], w,
+			    "changelog.Debian.gz", 20 - w, "");
+			if(col % 4 == 0) {
+				put(&p, "\r\n");
+			}
+		}
+	}
+	*len = p - buf;
+	return buf;
+}
+
+static char *
+gen_vim(size_t *len)
+{
+	char *buf, *p;
+	int line, i;
+
+	/* Scrolling a file a line at a time: scroll the text rows, draw
+	 * the new line with its number and update the ruler. */
+	if(!(p = buf = malloc(STREAM_SIZE + SLACK))) return NULL;
+	put(&p, "\033[?1049h\033[22;1H\033[2J");
+	for(line = 1; p - buf < STREAM_SIZE; ++line) {
+		put(&p, "\033[?25l\033[1;%dr\033[%d;1H\n\033[r", ROWS - 1, ROWS - 1);
+		put(&p, "\033[%d;1H\033[33m%4d \033[m", ROWS - 1, line);
+		for(i = rand() % 8; i >= 0; --i) {
+			put(&p, "\033[38;5;%dm%s\033[m ", 100 + rand() % 100,
+			    words[rand() % (sizeof(words) / sizeof(words[0]))]);
+		}
+		put(&p, "\033[K\033[%d;63H%d,1%11s\033[%d;6H\033[?25h", ROWS, line, "50%", ROWS - 1);
+	}
+	*len = p - buf;
+	return buf;
+}
+
+static char *
+gen_htop(size_t *len)
+{
+	char *buf, *p;
+	int row, i, n;
+
+	/* Meters drawn with bars, then a process list, each row placed. */
+	if(!(p = buf = malloc(STREAM_SIZE + SLACK))) return NULL;
+	while(p - buf < STREAM_SIZE) {
+		for(row = 0; row < 4; ++row) {
+			n = rand() % 30;
+			put(&p, "\033[%d;3H\033[1m%d\033[m[\033[32m", row + 1, row);
+			for(i = 0; i < n; ++i) {
+				*p++ = '|';
+			}
+			put(&p, "\033[m%*s\033[1m%4.1f%%\033[m]", 30 - n, "", n * 3.3);
+		}
+		put(&p, "\033[6;1H\033[30;42m  PID USER      PRI  NI  VIRT   RES S CPU%% MEM%%   TIME+  Command%23s\033[m", "");
+		for(row = 7; row <= ROWS; ++row) {
+			put(&p, "\033[%d;1H%5d root       20   0 %5dM %5dM S %4.1f  0.%d  0:%02d.%02d \033[36m/usr/bin/proc%d\033[m\033[K",
+			    row, 100 + row, rand() % 9999, rand() % 999, rand() % 100 / 10.0, rand() % 10,
+			    rand() % 60, rand() % 100, row);
+		}
+	}
+	*len = p - buf;
+	return buf;
+}
+
+static char *
+gen_yes(size_t *len)
+{
+	char *buf;
+	size_t i;
+
+	if(!(buf = malloc(STREAM_SIZE))) return NULL;
+	for(i = 0; i < STREAM_SIZE; i += 2) {
+		buf[i] = 'y';
+		buf[i + 1] = '\n';
+	}
+	*len = STREAM_SIZE;
+	return buf;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+sink(PTYState *state, Result *r)
+{
+	/* One write per frame takes everything queued. */
+	if(state->out.len) {
+		r->out += state->out.len;
+		++r->writes;
+	}
+	state->out.len = state->frame_mark = 0;
+}
+
+static Result
+replay(const char *buf, size_t len, int full)
+{
+	PTYState state;
+	Result r;
+	size_t off, n, budget;
+	double t;
+
+	init_state(&state);
+	state.x = full ? 0 : 4;
+	state.y = 0;
+	state.w = full ? COLS : COLS - 8;
+	state.h = ROWS;
+	state.right_edge = state.full_width = full;
+	state.fps = 0;
+	if(init_screen(&state)) {
+		exit(1);
+	}
+
+	memset(&r, 0, sizeof(r));
+	set_dirty_rows(&state, 0, state.h - 1);
+	present(&state);
+	sink(&state, &r);
+	t = now();
+	budget = 0;
+	for(off = 0; off < len; off += n) {
+		n = (len - off < BUFFER_SIZE) ? len - off : BUFFER_SIZE;
+		vt_feed(&state, buf + off, n);
+		++r.reads;
+		if((budget += n) >= READ_BUDGET || off + n == len) {
+			present(&state);
+			sink(&state, &r);
+			budget = 0;
+		}
+	}
+	r.seconds = now() - t;
+	r.in = len;
+
+	grid_free(&state.buffer);
+	grid_free(&state.shown);
+	grid_free(&state.alt);
+	attr_table_free(&state.attrs);
+	free(state.out.data);
+	return r;
+}
+
+static void
+report(const char *name, const char *buf, size_t len)
+{
+	Result r, best;
+	int full, i;
+
+	for(full = 0; full <= 1; ++full) {
+		best.seconds = 1e9;
+		for(i = 0; i < ROUNDS; ++i) {
+			r = replay(buf, len, full);
+			if(r.seconds < best.seconds) {
+				best = r;
+			}
+		}
+		printf("%-12s %-5s %8.1f MB/s %8.3f out/in %8.1f syscalls/MB\n",
+		       name, full ? "full" : "inset", best.in / best.seconds / 1e6,
+		       (double)best.out / best.in, (best.reads + best.writes) / (best.in / 1e6));
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const struct {
+		const char *name;
+		char *(*gen)(size_t *len);
+	} streams[] = {
+		{ "cat", gen_cat }, { "ls", gen_ls }, { "vim", gen_vim },
+		{ "htop", gen_htop }, { "yes", gen_yes },
+	};
+	struct rusage ru;
+	char *buf;
+	size_t len, n;
+	int i;
+
+	enc_init();
+	vt_init();
+	srand(1);
+	if(argc < 2) {
+		for(i = 0; i < (int)(sizeof(streams) / sizeof(streams[0])); ++i) {
+			if(!(buf = streams[i].gen(&len))) return 1;
+			report(streams[i].name, buf, len);
+			free(buf);
+		}
+	}
+	for(i = 1; i < argc; ++i) {
+		n = strlen(argv[i]);
+		buf = (n > 5 && !strcmp(argv[i] + n - 5, ".cast")) ?
+		      read_cast(argv[i], &len) : read_file(argv[i], &len);
+		if(!buf) return 1;
+		report(argv[i], buf, len);
+		free(buf);
+	}
+	getrusage(RUSAGE_SELF, &ru);
+	printf("peak RSS %ld kB\n", ru.ru_maxrss);
+	return 0;
+}
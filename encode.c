@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "encode.h"
+
+#define SGR_LEN		128
+
+/* SGR parameters for a colour selector, indexed by colour + 1 so that
+ * the default colour (-1) is entry 0. Filled once by enc_init(). */
+typedef struct {
+	char s[12];
+	int len;
+} Selector;
+
+static int rgb_to_palette(int color);
+
+static int append_rgb(char *p, const char *sel, int color);
+
+static int append_color(char *p, const Selector *sel, int color);
+
+static int sgr_params(char *p, Attr from, Attr to);
+
+static const char dec2[] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static const struct {
+	int flag;
+	const char *on, *off;
+} attr_codes[] = {
+	{ ATTR_BOLD, ";1", ";22" }, { ATTR_FAINT, ";2", ";22" },
+	{ ATTR_ITALIC, ";3", ";23" }, { ATTR_UNDERLINE, ";4", ";24" },
+	{ ATTR_BLINK, ";5", ";25" }, { ATTR_REVERSE, ";7", ";27" },
+	{ ATTR_CONCEAL, ";8", ";28" }, { ATTR_STRIKE, ";9", ";29" },
+};
+
+static Selector fg_sel[257];
+static Selector bg_sel[257];
+static int direct = 1;
+
+void
+enc_init(void)
+{
+	int i, base;
+	Selector *sel;
+
+	for(i = -1; i < 256; ++i) {
+		for(base = 30; base <= 40; base += 10) {
+			sel = (base == 30) ? fg_sel + i + 1 : bg_sel + i + 1;
+			sel->s[0] = ';';
+			if(i == -1) {
+				sel->len = 1 + enc_num(sel->s + 1, base + 9);
+			} else if(i < 8) {
+				sel->len = 1 + enc_num(sel->s + 1, base + i);
+			} else if(i < 16) {
+				sel->len = 1 + enc_num(sel->s + 1, base + 60 + i - 8);
+			} else {
+				sel->len = 1 + enc_num(sel->s + 1, base + 8);
+				memcpy(sel->s + sel->len, ";5;", 3);
+				sel->len += 3;
+				sel->len += enc_num(sel->s + sel->len, i);
+			}
+		}
+	}
+}
+
+void
+enc_truecolor(int on)
+{
+	direct = on;
+}
+
+void
+out_grow(OutBuf *out, size_t n)
+{
+	while(out->len + n > out->size) {
+		out->size = out->size ? out->size * 2 : OUTBUF_INIT_SIZE;
+	}
+	out->data = realloc(out->data, out->size);
+	if(!out->data) {
+		perror("realloc");
+		exit(1);
+	}
+}
+
+int
+enc_numlen(unsigned int n)
+{
+	int d;
+
+	for(d = 1; n >= 10; n /= 10) {
+		++d;
+	}
+	return d;
+}
+
+int
+enc_num(char *p, unsigned int n)
+{
+	char tmp[10], *t;
+	int len;
+
+	if(n < 10) {
+		*p = '0' + n;
+		return 1;
+	}
+	if(n < 100) {
+		memcpy(p, dec2 + 2 * n, 2);
+		return 2;
+	}
+
+	/* Two digits per step from the right, then copy out in order. */
+	t = tmp + sizeof(tmp);
+	while(n >= 100) {
+		t -= 2;
+		memcpy(t, dec2 + 2 * (n % 100), 2);
+		n /= 100;
+	}
+	if(n >= 10) {
+		t -= 2;
+		memcpy(t, dec2 + 2 * n, 2);
+	} else {
+		*--t = '0' + n;
+	}
+	len = tmp + sizeof(tmp) - t;
+	memcpy(p, t, len);
+	return len;
+}
+
+int
+enc_csi_len(int n)
+{
+	/* ESC [ n F, with n left out when it is 1. */
+	return (n == 1) ? 3 : 3 + enc_numlen(n);
+}
+
+void
+enc_csi(OutBuf *out, int n, char final)
+{
+	char *p;
+
+	out_reserve(out, 16);
+	p = out->data + out->len;
+	*p++ = '\033';
+	*p++ = '[';
+	if(n != 1) {
+		p += enc_num(p, n);
+	}
+	*p++ = final;
+	out->len = p - out->data;
+}
+
+void
+enc_csi2(OutBuf *out, int a, int b, char final)
+{
+	char *p;
+
+	out_reserve(out, 32);
+	p = out->data + out->len;
+	*p++ = '\033';
+	*p++ = '[';
+	p += enc_num(p, a);
+	*p++ = ';';
+	p += enc_num(p, b);
+	*p++ = final;
+	out->len = p - out->data;
+}
+
+void
+enc_params(OutBuf *out, const int *params, int n, unsigned int sub)
+{
+	char *p;
+	int i;
+
+	/* Bit i of sub puts a ':' before parameter i. */
+	out_reserve(out, n * 11);
+	p = out->data + out->len;
+	for(i = 0; i < n; ++i) {
+		if(i) {
+			*p++ = (sub >> i & 1) ? ':' : ';';
+		}
+		p += enc_num(p, params[i]);
+	}
+	out->len = p - out->data;
+}
+
+static int
+rgb_to_palette(int color)
+{
+	static const int level[6] = { 0, 95, 135, 175, 215, 255 };
+	int r, g, b, c[3], i, grey, dc, dg, d;
+
+	/* The nearest of the 6x6x6 cube and the grey ramp, by squared
+	 * distance in RGB. */
+	r = color >> 16 & 0xff;
+	g = color >> 8 & 0xff;
+	b = color & 0xff;
+	c[0] = r;
+	c[1] = g;
+	c[2] = b;
+	dc = 0;
+	for(i = 0; i < 3; ++i) {
+		c[i] = (c[i] < 48) ? 0 : (c[i] < 115) ? 1 : (c[i] - 35) / 40;
+	}
+	d = r - level[c[0]];
+	dc += d * d;
+	d = g - level[c[1]];
+	dc += d * d;
+	d = b - level[c[2]];
+	dc += d * d;
+
+	grey = (r + g + b) / 3;
+	grey = (grey < 8) ? 0 : (grey > 238) ? 23 : (grey - 3) / 10;
+	dg = 0;
+	d = r - (8 + 10 * grey);
+	dg += d * d;
+	d = g - (8 + 10 * grey);
+	dg += d * d;
+	d = b - (8 + 10 * grey);
+	dg += d * d;
+
+	return (dg < dc) ? 232 + grey : 16 + 36 * c[0] + 6 * c[1] + c[2];
+}
+
+static int
+append_rgb(char *p, const char *sel, int color)
+{
+	int len;
+
+	memcpy(p, sel, 6);
+	len = 6;
+	len += enc_num(p + len, color >> 16 & 0xff);
+	p[len++] = ';';
+	len += enc_num(p + len, color >> 8 & 0xff);
+	p[len++] = ';';
+	len += enc_num(p + len, color & 0xff);
+	return len;
+}
+
+static int
+append_color(char *p, const Selector *sel, int color)
+{
+	if(color >= COLOR_RGB) {
+		if(direct) {
+			return append_rgb(p, (sel == fg_sel) ? ";38;2;" : ";48;2;", color);
+		}
+		color = rgb_to_palette(color);
+	}
+	sel += color + 1;
+	memcpy(p, sel->s, sel->len);
+	return sel->len;
+}
+
+static int
+sgr_params(char *p, Attr from, Attr to)
+{
+	int i, len, removed, added;
+	size_t n;
+
+	len = 0;
+	removed = from.attr & ~to.attr;
+	added = to.attr & ~from.attr;
+	/* 22 clears both bold and faint, so whichever stays is set again. */
+	if(removed & (ATTR_BOLD | ATTR_FAINT)) {
+		added |= to.attr & (ATTR_BOLD | ATTR_FAINT);
+		removed |= ATTR_BOLD;
+		removed &= ~ATTR_FAINT;
+	}
+	for(i = 0; (removed | added) && i < sizeof(attr_codes) / sizeof(attr_codes[0]); ++i) {
+		if(removed & attr_codes[i].flag) {
+			n = strlen(attr_codes[i].off);
+			memcpy(p + len, attr_codes[i].off, n);
+			len += n;
+		}
+		if(added & attr_codes[i].flag) {
+			n = strlen(attr_codes[i].on);
+			memcpy(p + len, attr_codes[i].on, n);
+			len += n;
+		}
+	}
+	if(from.fg != to.fg) {
+		len += append_color(p + len, fg_sel, to.fg);
+	}
+	if(from.bg != to.bg) {
+		len += append_color(p + len, bg_sel, to.bg);
+	}
+	return len;
+}
+
+void
+enc_sgr(OutBuf *out, Attr from, Attr to)
+{
+	static const Attr plain = { -1, -1, 0 };
+	char delta[SGR_LEN], reset[SGR_LEN];
+	int dlen, rlen;
+	char *p;
+
+	/* Either change what differs, or reset and set what is wanted,
+	 * whichever is shorter. Parameter lists start with a ';'. */
+	reset[0] = '0';
+	rlen = sgr_params(reset + 1, plain, to);
+	rlen = rlen ? rlen + 1 : 0;
+	dlen = -1;
+	if(from.attr != -1) {
+		dlen = sgr_params(delta, from, to) - 1;
+	}
+
+	out_reserve(out, SGR_LEN + 3);
+	p = out->data + out->len;
+	*p++ = '\033';
+	*p++ = '[';
+	if(dlen != -1 && dlen < rlen) {
+		memcpy(p, delta + 1, dlen);
+		p += dlen;
+	} else {
+		memcpy(p, reset, rlen);
+		p += rlen;
+	}
+	*p++ = 'm';
+	out->len = p - out->data;
+}
@@ -0,0 +1,95 @@
+#ifndef ENCODE_H
+#define ENCODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "utf8.h"
+
+#define ATTR_BOLD		1
+#define ATTR_FAINT		2
+#define ATTR_ITALIC		4
+#define ATTR_UNDERLINE		8
+#define ATTR_BLINK		16
+#define ATTR_REVERSE		32
+#define ATTR_CONCEAL		64
+#define ATTR_STRIKE		128
+
+#define COLOR_RGB		0x1000000	/* Or'ed with 0xrrggbb. */
+
+#define OUTBUF_INIT_SIZE	16384
+
+#define ANSIESC "\033["
+
+#define out_str(O, L) out_write(O, L, sizeof(L) - 1)
+
+/* Colours are -1 for the default, 0 to 255 from the palette, or direct
+ * with COLOR_RGB set. */
+typedef struct {
+	int fg;
+	int bg;
+	int attr;
+} Attr;
+
+typedef struct {
+	char *data;
+	size_t len, size;
+} OutBuf;
+
+void enc_init(void);
+
+/* Off, direct colours go out as the nearest of the 256 palette. */
+void enc_truecolor(int on);
+
+void out_grow(OutBuf *out, size_t n);
+
+int enc_num(char *p, unsigned int n);
+
+int enc_numlen(unsigned int n);
+
+int enc_csi_len(int n);
+
+void enc_csi(OutBuf *out, int n, char final);
+
+void enc_csi2(OutBuf *out, int a, int b, char final);
+
+void enc_params(OutBuf *out, const int *params, int n, unsigned int sub);
+
+void enc_sgr(OutBuf *out, Attr from, Attr to);
+
+static inline void
+out_reserve(OutBuf *out, size_t n)
+{
+	if(out->len + n > out->size) {
+		out_grow(out, n);
+	}
+}
+
+static inline void
+out_write(OutBuf *out, const char *s, size_t n)
+{
+	out_reserve(out, n);
+	memcpy(out->data + out->len, s, n);
+	out->len += n;
+}
+
+static inline void
+out_putc(OutBuf *out, char c)
+{
+	out_reserve(out, 1);
+	out->data[out->len++] = c;
+}
+
+static inline void
+out_char(OutBuf *out, uint32_t cp)
+{
+	if(cp < 0x80) {
+		out_putc(out, cp);
+		return;
+	}
+	out_reserve(out, 4);
+	out->len += utf8_encode(out->data + out->len, cp);
+}
+
+#endif
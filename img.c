@@ -0,0 +1,599 @@
+#include <png.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "img.h"
+
+#define LEVELS_R	6		/* The sixel palette is a 6x7x6 cube, */
+#define LEVELS_G	7
+#define LEVELS_B	6
+#define PALETTE_SIZE	(LEVELS_R * LEVELS_G * LEVELS_B)
+#define DITHER_SIZE	8		/* dithered with an 8x8 Bayer matrix. */
+#define KITTY_CHUNK	4096		/* Base64 bytes per APC, as kitty asks. */
+#define MAX_THREADS	64
+#define MIN_ROWS	32		/* Fewer rows are not worth a thread. */
+
+/* A pixel as four floats, the last unused, summed with weights. */
+#ifdef __SSE2__
+typedef __m128 Pixel;
+#else
+typedef struct {
+	float c[4];
+} Pixel;
+#endif
+
+/* Which source pixels make up each destination pixel along an axis,
+ * and by how much: taps weights from start, some of them 0. */
+typedef struct {
+	int *start;
+	float *weight;
+	int taps;
+} Taps;
+
+typedef struct {
+	const Image *src;
+	Image *dst;
+	const Taps *tx, *ty;
+	int y0, y1;			/* Destination rows of this job. */
+} ScaleJob;
+
+typedef struct {
+	const Image *img;
+	int w, y0, y1;			/* Rows of this job, whole bands. */
+	OutBuf out;
+} SixelJob;
+
+static int png_begin(png_image *png, const char *path);
+
+static int taps_init(Taps *t, int from, int to);
+
+static void taps_free(Taps *t);
+
+static int job_count(int rows);
+
+static void run_jobs(void *(*fn)(void *), void *jobs, size_t size, int n);
+
+static Pixel px_zero(void);
+
+static Pixel px_load(const unsigned char *p);
+
+static Pixel px_madd(Pixel acc, float w, Pixel p);
+
+static void px_store(unsigned char *q, Pixel p);
+
+static void *scale_rows(void *arg);
+
+static void dither_init(void);
+
+static void sixel_run(OutBuf *out, int n, int bits);
+
+static void *sixel_bands(void *arg);
+
+static const char b64[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const unsigned char bayer[DITHER_SIZE][DITHER_SIZE] = {
+	{  0, 32,  8, 40,  2, 34, 10, 42 }, { 48, 16, 56, 24, 50, 18, 58, 26 },
+	{ 12, 44,  4, 36, 14, 46,  6, 38 }, { 60, 28, 52, 20, 62, 30, 54, 22 },
+	{  3, 35, 11, 43,  1, 33,  9, 41 }, { 51, 19, 59, 27, 49, 17, 57, 25 },
+	{ 15, 47,  7, 39, 13, 45,  5, 37 }, { 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+/* A channel's part of the palette index, by threshold and value. */
+static unsigned char dither[3][DITHER_SIZE * DITHER_SIZE][256];
+static pthread_once_t dither_once = PTHREAD_ONCE_INIT;
+static int threads;
+
+static int
+png_begin(png_image *png, const char *path)
+{
+	memset(png, 0, sizeof(*png));
+	png->version = PNG_IMAGE_VERSION;
+	if(!png_image_begin_read_from_file(png, path)) {
+		fprintf(stderr, "%s: %s\n", path, png->message);
+		return 1;
+	}
+	return 0;
+}
+
+void
+img_threads(int n)
+{
+	threads = (n > MAX_THREADS) ? MAX_THREADS : n;
+}
+
+int
+img_size(const char *path, int *w, int *h)
+{
+	png_image png;
+
+	/* Only the header is read. */
+	if(png_begin(&png, path)) return 1;
+	*w = png.width;
+	*h = png.height;
+	png_image_free(&png);
+	return 0;
+}
+
+int
+img_load(Image *img, const char *path)
+{
+	png_image png;
+	png_color black = { 0, 0, 0 };
+
+	img->rgb = NULL;
+	if(png_begin(&png, path)) return 1;
+	png.format = PNG_FORMAT_RGB;
+	img->w = png.width;
+	img->h = png.height;
+	if(!(img->rgb = malloc(PNG_IMAGE_SIZE(png)))) {
+		perror("malloc");
+		png_image_free(&png);
+		return 1;
+	}
+	if(!png_image_finish_read(&png, &black, img->rgb, 0, NULL)) {
+		fprintf(stderr, "%s: %s\n", path, png.message);
+		img_free(img);
+		return 1;
+	}
+	return 0;
+}
+
+static int
+taps_init(Taps *t, int from, int to)
+{
+	double scale, a, b, lo, hi;
+	int i, k, s;
+
+	/* Destination pixel i covers [a, b) of the source, and each source
+	 * pixel counts for as much of that as it covers. */
+	scale = (double)from / to;
+	t->taps = ((int)scale + 2 < from) ? (int)scale + 2 : from;
+	t->start = malloc(to * sizeof(*t->start));
+	t->weight = malloc((size_t)to * t->taps * sizeof(*t->weight));
+	if(!t->start || !t->weight) {
+		perror("malloc");
+		taps_free(t);
+		return 1;
+	}
+	for(i = 0; i < to; ++i) {
+		a = i * scale;
+		b = (i + 1) * scale;
+		s = (int)a;
+		s = (s + t->taps > from) ? ((from > t->taps) ? from - t->taps : 0) : s;
+		t->start[i] = s;
+		for(k = 0; k < t->taps; ++k) {
+			lo = (s + k > a) ? s + k : a;
+			hi = (s + k + 1 < b) ? s + k + 1 : b;
+			t->weight[i * t->taps + k] = (hi > lo && s + k < from) ? (hi - lo) / (b - a) : 0;
+		}
+	}
+	return 0;
+}
+
+static void
+taps_free(Taps *t)
+{
+	free(t->start);
+	free(t->weight);
+	t->start = NULL;
+	t->weight = NULL;
+}
+
+static int
+job_count(int rows)
+{
+	int n;
+
+	n = threads ? threads : sysconf(_SC_NPROCESSORS_ONLN);
+	n = (n > rows / MIN_ROWS) ? rows / MIN_ROWS : n;
+	n = (n > MAX_THREADS) ? MAX_THREADS : n;
+	return (n < 1) ? 1 : n;
+}
+
+static void
+run_jobs(void *(*fn)(void *), void *jobs, size_t size, int n)
+{
+	pthread_t tid[MAX_THREADS];
+	int i, started;
+
+	/* The first job runs here, as do any that got no thread. */
+	for(started = 1; started < n; ++started) {
+		if(pthread_create(&tid[started], NULL, fn, (char *)jobs + started * size)) break;
+	}
+	fn(jobs);
+	for(i = started; i < n; ++i) {
+		fn((char *)jobs + i * size);
+	}
+	for(i = 1; i < started; ++i) {
+		pthread_join(tid[i], NULL);
+	}
+}
+
+#ifdef __SSE2__
+static Pixel
+px_zero(void)
+{
+	return _mm_setzero_ps();
+}
+
+static Pixel
+px_load(const unsigned char *p)
+{
+	__m128i v;
+
+	v = _mm_cvtsi32_si128(p[0] | p[1] << 8 | p[2] << 16);
+	v = _mm_unpacklo_epi8(v, _mm_setzero_si128());
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128()));
+}
+
+static Pixel
+px_madd(Pixel acc, float w, Pixel p)
+{
+	return _mm_add_ps(acc, _mm_mul_ps(_mm_set1_ps(w), p));
+}
+
+static void
+px_store(unsigned char *q, Pixel p)
+{
+	__m128i v;
+	int c;
+
+	/* Rounded, and saturated on the way down to bytes. */
+	v = _mm_cvtps_epi32(p);
+	v = _mm_packs_epi32(v, v);
+	c = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+	q[0] = c;
+	q[1] = c >> 8;
+	q[2] = c >> 16;
+}
+#else
+static Pixel
+px_zero(void)
+{
+	Pixel p = { { 0, 0, 0, 0 } };
+
+	return p;
+}
+
+static Pixel
+px_load(const unsigned char *p)
+{
+	Pixel v = { { p[0], p[1], p[2], 0 } };
+
+	return v;
+}
+
+static Pixel
+px_madd(Pixel acc, float w, Pixel p)
+{
+	int i;
+
+	for(i = 0; i < 3; ++i) {
+		acc.c[i] += w * p.c[i];
+	}
+	return acc;
+}
+
+static void
+px_store(unsigned char *q, Pixel p)
+{
+	int i;
+
+	for(i = 0; i < 3; ++i) {
+		q[i] = (p.c[i] < 0) ? 0 : (p.c[i] > 255) ? 255 : (int)(p.c[i] + 0.5f);
+	}
+}
+#endif
+
+static void *
+scale_rows(void *arg)
+{
+	ScaleJob *job = arg;
+	const Taps *tx = job->tx, *ty = job->ty;
+	const unsigned char *s;
+	const float *wx;
+	unsigned char *q;
+	Pixel *ring, *row, *acc, *line, *p;
+	int *tag;
+	int x, y, k, j, sy, w;
+
+	/* Source rows are scaled across as they are needed, into a ring
+	 * that keeps them for the next destination row that covers them. */
+	w = job->dst->w;
+	ring = malloc((size_t)ty->taps * w * sizeof(*ring));
+	acc = malloc(w * sizeof(*acc));
+	line = malloc(job->src->w * sizeof(*line));
+	tag = malloc(ty->taps * sizeof(*tag));
+	if(!ring || !acc || !line || !tag) {
+		perror("malloc");
+		exit(1);
+	}
+	for(k = 0; k < ty->taps; ++k) {
+		tag[k] = -1;
+	}
+	for(y = job->y0; y < job->y1; ++y) {
+		for(x = 0; x < w; ++x) {
+			acc[x] = px_zero();
+		}
+		for(k = 0; k < ty->taps; ++k) {
+			if(ty->weight[y * ty->taps + k] == 0) continue;
+			sy = ty->start[y] + k;
+			row = ring + (size_t)(sy % ty->taps) * w;
+			if(tag[sy % ty->taps] != sy) {
+				tag[sy % ty->taps] = sy;
+				s = job->src->rgb + (size_t)sy * job->src->w * 3;
+				for(x = 0; x < job->src->w; ++x, s += 3) {
+					line[x] = px_load(s);
+				}
+				for(x = 0; x < w; ++x) {
+					p = line + tx->start[x];
+					wx = tx->weight + x * tx->taps;
+					row[x] = px_zero();
+					for(j = 0; j < tx->taps; ++j) {
+						row[x] = px_madd(row[x], wx[j], p[j]);
+					}
+				}
+			}
+			for(x = 0; x < w; ++x) {
+				acc[x] = px_madd(acc[x], ty->weight[y * ty->taps + k], row[x]);
+			}
+		}
+		q = job->dst->rgb + (size_t)y * w * 3;
+		for(x = 0; x < w; ++x, q += 3) {
+			px_store(q, acc[x]);
+		}
+	}
+	free(ring);
+	free(acc);
+	free(line);
+	free(tag);
+	return NULL;
+}
+
+int
+img_scale(Image *dst, const Image *src, int w, int h)
+{
+	ScaleJob jobs[MAX_THREADS];
+	Taps tx, ty;
+	int i, n;
+
+	/* An area average, each pixel the mean of what it covers, in bands
+	 * of rows on as many threads as there are cores. */
+	dst->w = w;
+	dst->h = h;
+	if(!(dst->rgb = malloc((size_t)w * h * 3))) {
+		perror("malloc");
+		return 1;
+	}
+	tx.start = ty.start = NULL;
+	tx.weight = ty.weight = NULL;
+	if(taps_init(&tx, src->w, w) || taps_init(&ty, src->h, h)) {
+		taps_free(&tx);
+		img_free(dst);
+		return 1;
+	}
+	n = job_count(h);
+	for(i = 0; i < n; ++i) {
+		jobs[i].src = src;
+		jobs[i].dst = dst;
+		jobs[i].tx = &tx;
+		jobs[i].ty = &ty;
+		jobs[i].y0 = (long long)h * i / n;
+		jobs[i].y1 = (long long)h * (i + 1) / n;
+	}
+	run_jobs(scale_rows, jobs, sizeof(*jobs), n);
+	taps_free(&tx);
+	taps_free(&ty);
+	return 0;
+}
+
+void
+img_free(Image *img)
+{
+	free(img->rgb);
+	img->rgb = NULL;
+}
+
+static void
+dither_init(void)
+{
+	static const int levels[3] = { LEVELS_R, LEVELS_G, LEVELS_B };
+	static const int stride[3] = { LEVELS_G * LEVELS_B, LEVELS_B, 1 };
+	int c, t, v, i, n;
+
+	/* A value between two levels takes the upper one where it is
+	 * further up than the threshold of its place in the matrix. */
+	n = 2 * DITHER_SIZE * DITHER_SIZE;
+	for(c = 0; c < 3; ++c) {
+		for(t = 0; t < DITHER_SIZE * DITHER_SIZE; ++t) {
+			for(v = 0; v < 256; ++v) {
+				i = (v * (levels[c] - 1) * n / 255 + 2 * t + 1) / n;
+				i = (i >= levels[c]) ? levels[c] - 1 : i;
+				dither[c][t][v] = i * stride[c];
+			}
+		}
+	}
+}
+
+static void
+sixel_run(OutBuf *out, int n, int bits)
+{
+	/* Repeats of three or less are shorter written out. */
+	if(n > 3) {
+		out_reserve(out, 16);
+		out->data[out->len++] = '!';
+		out->len += enc_num(out->data + out->len, n);
+		out->data[out->len++] = 63 + bits;
+		return;
+	}
+	while(n--) {
+		out_putc(out, 63 + bits);
+	}
+}
+
+static void *
+sixel_bands(void *arg)
+{
+	SixelJob *job = arg;
+	OutBuf *out = &job->out;
+	unsigned char *index, *bits, used[PALETTE_SIZE];
+	const unsigned char *p, *t;
+	int list[PALETTE_SIZE];
+	int i, n, w, x, y, r, c, end, run;
+
+	w = job->w;
+	if(!(index = malloc((size_t)w * 6)) || !(bits = malloc((size_t)PALETTE_SIZE * w))) {
+		perror("malloc");
+		exit(1);
+	}
+
+	/* A band of six rows is drawn a colour at a time, each colour a
+	 * row of sixels with the bits of the pixels that have it. */
+	memset(used, 0, sizeof(used));
+	for(y = job->y0; y < job->y1; y += 6) {
+		for(r = 0; r < 6 && y + r < job->y1; ++r) {
+			p = job->img->rgb + (size_t)(y + r) * job->img->w * 3;
+			t = bayer[(y + r) % DITHER_SIZE];
+			for(x = 0; x < w; ++x, p += 3) {
+				i = t[x % DITHER_SIZE];
+				index[r * w + x] = dither[0][i][p[0]] + dither[1][i][p[1]] + dither[2][i][p[2]];
+			}
+		}
+		n = 0;
+		for(r = 0; r < 6 && y + r < job->y1; ++r) {
+			for(x = 0; x < w; ++x) {
+				c = index[r * w + x];
+				if(!used[c]) {
+					used[c] = 1;
+					list[n++] = c;
+					memset(bits + c * w, 0, w);
+				}
+				bits[c * w + x] |= 1 << r;
+			}
+		}
+		for(i = 0; i < n; ++i) {
+			c = list[i];
+			used[c] = 0;
+			for(end = w; end > 0 && !bits[c * w + end - 1]; --end);
+			out_reserve(out, 8);
+			out->data[out->len++] = '#';
+			out->len += enc_num(out->data + out->len, c);
+			for(x = 0; x < end; x += run) {
+				for(run = 1; x + run < end && bits[c * w + x + run] == bits[c * w + x]; ++run);
+				sixel_run(out, run, bits[c * w + x]);
+			}
+			out_putc(out, (i + 1 < n) ? '$' : '-');
+		}
+	}
+	free(index);
+	free(bits);
+	return NULL;
+}
+
+void
+img_sixel(OutBuf *out, const Image *img, int w, int h)
+{
+	SixelJob jobs[MAX_THREADS];
+	int i, n, bands;
+
+	w = (w < img->w) ? w : img->w;
+	h = (h < img->h) ? h : img->h;
+	if(w <= 0 || h <= 0) return;
+	pthread_once(&dither_once, dither_init);
+
+	out_str(out, "\033Pq\"1;1;");
+	out_reserve(out, 32);
+	out->len += enc_num(out->data + out->len, w);
+	out->data[out->len++] = ';';
+	out->len += enc_num(out->data + out->len, h);
+	for(i = 0; i < PALETTE_SIZE; ++i) {
+		out_reserve(out, 32);
+		out->data[out->len++] = '#';
+		out->len += enc_num(out->data + out->len, i);
+		out_str(out, ";2;");
+		out->len += enc_num(out->data + out->len, i / (LEVELS_G * LEVELS_B) * 100 / (LEVELS_R - 1));
+		out->data[out->len++] = ';';
+		out->len += enc_num(out->data + out->len, i / LEVELS_B % LEVELS_G * 100 / (LEVELS_G - 1));
+		out->data[out->len++] = ';';
+		out->len += enc_num(out->data + out->len, i % LEVELS_B * 100 / (LEVELS_B - 1));
+	}
+
+	/* The bands are shared out among threads, and their sixels joined
+	 * in order. */
+	n = job_count(h);
+	bands = (h + 5) / 6;
+	for(i = 0; i < n; ++i) {
+		jobs[i].img = img;
+		jobs[i].w = w;
+		jobs[i].y0 = bands * i / n * 6;
+		jobs[i].y1 = (i + 1 < n) ? bands * (i + 1) / n * 6 : h;
+		memset(&jobs[i].out, 0, sizeof(jobs[i].out));
+	}
+	run_jobs(sixel_bands, jobs, sizeof(*jobs), n);
+	for(i = 0; i < n; ++i) {
+		out_write(out, jobs[i].out.data, jobs[i].out.len);
+		free(jobs[i].out.data);
+	}
+	out_str(out, "\033\\");
+}
+
+void
+img_kitty(OutBuf *out, const Image *img, int w, int h, int xoff, int yoff)
+{
+	unsigned char *row, *s;
+	size_t len, i, chunk;
+	unsigned int v;
+	int y;
+	char *d;
+
+	w = (w < img->w) ? w : img->w;
+	h = (h < img->h) ? h : img->h;
+	if(w <= 0 || h <= 0) return;
+
+	/* The pixels of the rectangle, as one run of RGB. Its length and
+	 * the chunks are whole pixels, so base64 never needs padding. */
+	len = (size_t)w * h * 3;
+	if(!(row = malloc(len))) {
+		perror("malloc");
+		exit(1);
+	}
+	for(y = 0; y < h; ++y) {
+		memcpy(row + (size_t)y * w * 3, img->rgb + (size_t)y * img->w * 3, (size_t)w * 3);
+	}
+
+	/* Placed under the text, without moving the cursor or replying. */
+	out_reserve(out, 96);
+	out->len += sprintf(out->data + out->len, "\033_Ga=T,f=24,s=%d,v=%d,X=%d,Y=%d,C=1,z=-1,q=2",
+	                    w, h, xoff, yoff);
+	for(i = 0; i < len; i += chunk) {
+		chunk = (len - i < KITTY_CHUNK / 4 * 3) ? len - i : KITTY_CHUNK / 4 * 3;
+		/* Only the first chunk has keys besides m. */
+		if(i) {
+			out_str(out, "\033_Gm=");
+		} else {
+			out_str(out, ",m=");
+		}
+		out_putc(out, (i + chunk < len) ? '1' : '0');
+		out_putc(out, ';');
+		out_reserve(out, KITTY_CHUNK + 2);
+		d = out->data + out->len;
+		for(s = row + i; s + 3 <= row + i + chunk; s += 3) {
+			v = s[0] << 16 | s[1] << 8 | s[2];
+			*d++ = b64[v >> 18];
+			*d++ = b64[v >> 12 & 63];
+			*d++ = b64[v >> 6 & 63];
+			*d++ = b64[v & 63];
+		}
+		out->len = d - out->data;
+		out_str(out, "\033\\");
+	}
+	free(row);
+}
@@ -0,0 +1,28 @@
+#ifndef IMG_H
+#define IMG_H
+
+#include "encode.h"
+
+/* Images as 8 bit RGB, alpha blended onto black when they are loaded. */
+typedef struct {
+	int w, h;
+	unsigned char *rgb;		/* w * h pixels, 3 bytes each. */
+} Image;
+
+/* Threads to scale and encode with, 0 for one per core. */
+void img_threads(int n);
+
+int img_size(const char *path, int *w, int *h);
+
+int img_load(Image *img, const char *path);
+
+int img_scale(Image *dst, const Image *src, int w, int h);
+
+void img_free(Image *img);
+
+/* Both draw the top left w by h pixels of img at the cursor. */
+void img_sixel(OutBuf *out, const Image *img, int w, int h);
+
+void img_kitty(OutBuf *out, const Image *img, int w, int h, int xoff, int yoff);
+
+#endif
@@ -0,0 +1,280 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "probe.h"
+
+#define PROBE_BUFFER	4096
+#define PROBE_PARAMS	16
+
+/* Modes are asked first, and DA1 last: every terminal answers it, and
+ * in order, so its reply means the others have come or never will. The
+ * APC asks about kitty graphics with an image of one pixel, only of
+ * those who would draw with it. */
+#define PROBE_MODES	"\033[?69$p\033[?2026$p\033[>0q"
+#define PROBE_KITTY	"\033_Gi=31,s=1,v=1,a=q,t=d,f=24;AAAA\033\\"
+#define PROBE_DA	"\033[>c\033[c"
+
+/* Terminals known by XTVERSION or DA2 for what no query reveals. */
+static const struct {
+	const char *name;
+	int type;
+	int rep, truecolor;
+} known[] = {
+	{ "XTerm", 41, 1, 1 },
+	{ "tmux", 84, 1, 1 },
+	{ "kitty", -1, 1, 1 },
+	{ "foot", -1, 1, 1 },
+	{ "WezTerm", -1, 1, 1 },
+	{ "contour", -1, 1, 1 },
+	{ "VTE", 65, 0, 1 },
+};
+
+static long long now_ms(void);
+
+static int write_all(int fd, const char *s, size_t n);
+
+static size_t scan_csi(const char *s, size_t n, Caps *caps);
+
+static size_t scan_string(const char *s, size_t n, Caps *caps);
+
+static void scan_replies(const char *s, size_t n, Caps *caps,
+                         char *typeahead, size_t *tn, size_t size);
+
+static void derive(Caps *caps);
+
+static long long
+now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int
+write_all(int fd, const char *s, size_t n)
+{
+	ssize_t r;
+
+	for(; n > 0; s += r, n -= r) {
+		r = write(fd, s, n);
+		if(r < 0 && errno == EINTR) {
+			r = 0;
+			continue;
+		}
+		if(r < 0) return 1;
+	}
+	return 0;
+}
+
+static size_t
+scan_csi(const char *s, size_t n, Caps *caps)
+{
+	int params[PROBE_PARAMS];
+	int np, i;
+	size_t j;
+	char marker, inter;
+
+	/* Returns the length of a reply at s, 0 if it is not complete yet,
+	 * or (size_t)-1 if it is no reply of ours but a key. */
+	j = 2;
+	marker = (j < n && s[j] && strchr("<=>?", s[j])) ? s[j++] : 0;
+	np = 0;
+	params[0] = 0;
+	for(; j < n && ((s[j] >= '0' && s[j] <= '9') || s[j] == ';' || s[j] == ':'); ++j) {
+		if(s[j] >= '0' && s[j] <= '9') {
+			if(np < PROBE_PARAMS) {
+				params[np] = params[np] * 10 + s[j] - '0';
+			}
+		} else if(++np < PROBE_PARAMS) {
+			params[np] = 0;
+		}
+	}
+	++np;
+	np = (np > PROBE_PARAMS) ? PROBE_PARAMS : np;
+	inter = 0;
+	for(; j < n && s[j] >= 0x20 && s[j] <= 0x2f; ++j) {
+		inter = s[j];
+	}
+	if(j >= n) return 0;
+
+	if(marker == '?' && !inter && s[j] == 'c') {
+		/* 61 and up is the VT level plus 60, below that VT100 class. */
+		caps->answered = 1;
+		caps->level = (params[0] > 60) ? params[0] - 60 : 1;
+		for(i = 1; i < np; ++i) {
+			if(params[i] == 4) caps->sixel = 1;
+		}
+	} else if(marker == '>' && !inter && s[j] == 'c') {
+		caps->type = params[0];
+		caps->version = (np > 1) ? params[1] : 0;
+	} else if(marker == '?' && inter == '$' && s[j] == 'y' && np > 1) {
+		if(params[0] == 69) caps->mode_margins = params[1];
+		if(params[0] == 2026) caps->mode_sync = params[1];
+	} else {
+		return (size_t)-1;
+	}
+	return j + 1;
+}
+
+static size_t
+scan_string(const char *s, size_t n, Caps *caps)
+{
+	size_t j, len;
+
+	/* Strings only come as replies, XTVERSION's is DCS > | name ST
+	 * and kitty's APC G i=31;OK ST. */
+	for(j = 2; j + 1 < n && !(s[j] == '\033' && s[j + 1] == '\\'); ++j);
+	if(j + 1 >= n) return 0;
+	if(s[1] == '_') {
+		if(j >= 10 && !memcmp(s + 2, "Gi=31;OK", 8)) {
+			caps->kitty = 1;
+		}
+	} else if(j >= 4 && s[2] == '>' && s[3] == '|') {
+		len = j - 4;
+		len = (len < sizeof(caps->name)) ? len : sizeof(caps->name) - 1;
+		memcpy(caps->name, s + 4, len);
+		caps->name[len] = '\0';
+	}
+	return j + 2;
+}
+
+static void
+scan_replies(const char *s, size_t n, Caps *caps, char *typeahead, size_t *tn, size_t size)
+{
+	size_t i, k;
+
+	/* Replies are taken out, everything else was typed meanwhile. */
+	*tn = 0;
+	for(i = 0; i < n; i += k) {
+		k = 1;
+		if(s[i] == '\033' && i + 1 < n && (s[i + 1] == '[' || s[i + 1] == 'P' || s[i + 1] == '_')) {
+			k = (s[i + 1] == '[') ? scan_csi(s + i, n - i, caps) : scan_string(s + i, n - i, caps);
+			if(!k) return;
+			if(k != (size_t)-1) continue;
+			k = 1;
+		}
+		if(*tn < size) {
+			typeahead[(*tn)++] = s[i];
+		}
+	}
+}
+
+static void
+derive(Caps *caps)
+{
+	const char *colorterm;
+	size_t i, len;
+
+	if(!caps->answered) return;
+
+	/* Modes are there if the terminal knows them, set or not, except
+	 * for a mode it keeps off for good. */
+	caps->margins = caps->mode_margins >= 1 && caps->mode_margins <= 3;
+	caps->sync = caps->mode_sync >= 1 && caps->mode_sync <= 3;
+	caps->ech = caps->level >= 2;
+	caps->rep = 0;
+	colorterm = getenv("COLORTERM");
+	caps->truecolor = colorterm && (!strcmp(colorterm, "truecolor") || !strcmp(colorterm, "24bit"));
+	for(i = 0; i < sizeof(known) / sizeof(known[0]); ++i) {
+		len = strlen(known[i].name);
+		if((caps->name[0] && !strncasecmp(caps->name, known[i].name, len)) ||
+		   (!caps->name[0] && caps->type != -1 && caps->type == known[i].type)) {
+			caps->ech = 1;
+			caps->rep = known[i].rep;
+			caps->truecolor |= known[i].truecolor;
+			break;
+		}
+	}
+}
+
+void
+probe_defaults(Caps *caps)
+{
+	memset(caps, 0, sizeof(*caps));
+	caps->kitty = -1;
+	caps->type = caps->version = -1;
+	caps->mode_margins = caps->mode_sync = -1;
+	caps->margins = caps->sync = caps->ech = caps->truecolor = 1;
+	caps->rep = 0;
+}
+
+int
+probe_terminal(int in, int out, int timeout_ms, int kitty, Caps *caps, char *typeahead, size_t *n, size_t size)
+{
+	char buf[PROBE_BUFFER];
+	struct pollfd pfd;
+	long long deadline, left;
+	size_t len;
+	ssize_t r;
+
+	probe_defaults(caps);
+	*n = 0;
+	if(!isatty(in) || !isatty(out)) return 0;
+
+	if(write_all(out, PROBE_MODES, sizeof(PROBE_MODES) - 1) ||
+	   (kitty && write_all(out, PROBE_KITTY, sizeof(PROBE_KITTY) - 1)) ||
+	   write_all(out, PROBE_DA, sizeof(PROBE_DA) - 1)) {
+		return 0;
+	}
+	if(kitty) {
+		caps->kitty = 0;
+	}
+
+	len = 0;
+	deadline = now_ms() + timeout_ms;
+	while(!caps->answered && len < sizeof(buf) && (left = deadline - now_ms()) > 0) {
+		pfd.fd = in;
+		pfd.events = POLLIN;
+		r = poll(&pfd, 1, left);
+		if(r < 0 && errno == EINTR) continue;
+		if(r <= 0) break;
+		r = read(in, buf + len, sizeof(buf) - len);
+		if(r < 0 && errno == EINTR) continue;
+		if(r <= 0) break;
+		len += r;
+		scan_replies(buf, len, caps, typeahead, n, size);
+	}
+	derive(caps);
+	return caps->answered;
+}
+
+size_t
+probe_discard(char *s, size_t n, int *answered)
+{
+	Caps late;
+	size_t tn;
+
+	/* Replies that come after the probe gave up are taken out of the
+	 * input in place, up to the DA1 that ends them. */
+	probe_defaults(&late);
+	scan_replies(s, n, &late, s, &tn, n);
+	*answered = late.answered;
+	return tn;
+}
+
+void
+probe_print(FILE *f, const Caps *caps)
+{
+	static const char *yn[] = { "no", "yes" };
+
+	if(!caps->answered) {
+		fprintf(f, "terminal:  no answer, assuming the defaults\n");
+	} else {
+		fprintf(f, "terminal:  %s, DA1 level %d, DA2 type %d version %d\n",
+		        caps->name[0] ? caps->name : "unnamed", caps->level, caps->type, caps->version);
+		fprintf(f, "modes:     ?69 %d, ?2026 %d\n", caps->mode_margins, caps->mode_sync);
+	}
+	fprintf(f, "margins:   %s\n", yn[caps->margins]);
+	fprintf(f, "sync:      %s\n", yn[caps->sync]);
+	fprintf(f, "ech:       %s\n", yn[caps->ech]);
+	fprintf(f, "rep:       %s\n", yn[caps->rep]);
+	fprintf(f, "truecolor: %s\n", yn[caps->truecolor]);
+	fprintf(f, "sixel:     %s\n", yn[caps->sixel]);
+	fprintf(f, "kitty:     %s\n", (caps->kitty < 0) ? "not asked" : yn[caps->kitty]);
+}
@@ -0,0 +1,37 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define PROBE_TIMEOUT_MS	200
+#define PROBE_LATE_MS		1000	/* Replies looked for after a timeout. */
+
+/* What the outer terminal said about itself, and what follows from it.
+ * Without an answer the profile is what pty-shell always assumed. */
+typedef struct {
+	int answered;			/* The DA1 reply, sent last, came back. */
+	int level;			/* DA1 conformance level, 1 for VT100. */
+	int sixel;			/* DA1 lists sixel graphics. */
+	int kitty;			/* The kitty graphics query was answered, -1 if not asked. */
+	int type, version;		/* DA2, -1 if not answered. */
+	char name[64];			/* XTVERSION, empty if not answered. */
+	int mode_margins, mode_sync;	/* DECRQM of ?69 and ?2026, -1 if none. */
+
+	int margins;			/* DECSLRM left/right margins. */
+	int sync;			/* Synchronized output. */
+	int ech;			/* ECH, ICH and DCH. */
+	int rep;			/* REP. */
+	int truecolor;			/* Direct colour SGR. */
+} Caps;
+
+void probe_defaults(Caps *caps);
+
+int probe_terminal(int in, int out, int timeout_ms, int kitty, Caps *caps,
+                   char *typeahead, size_t *n, size_t size);
+
+size_t probe_discard(char *s, size_t n, int *answered);
+
+void probe_print(FILE *f, const Caps *caps);
+
+#endif
@@ -1,103 +1,542 @@
 #include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <pty.h>
 #include <termios.h>
 #include <fcntl.h>
 #include <string.h>
 #include <stdlib.h>
-#include <ctype.h>
+#include <stdint.h>
 #include <getopt.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <signal.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "encode.h"
+#include "img.h"
+#include "probe.h"
+#include "record.h"
+#include "utf8.h"
 
 #define MAX_PARAMS		16
-#define BUFFER_SIZE		1024
-#define CSI_BUFFER_SIZE		256
+#define MAX_INTERMEDIATES	2
+#define BUFFER_SIZE		4096
+#define READ_BUDGET		65536	/* Child output parsed between frames. */
+#define INPUT_QUEUE_SIZE	65536	/* Keys waiting for the child. */
+#define OUTPUT_QUEUE_LIMIT	262144	/* Stop reading the child above this. */
 #define DEF_MARGIN_H 4
 #define DEF_MARGIN_V 8
 #define DEF_CHILD "/bin/sh"
 #define CHILD_LEN 256
-
-#define ATTR_BOLD		1
-#define ATTR_FAINT		2
-#define ATTR_ITALIC		4
-#define ATTR_UNDERLINE		8
-#define ATTR_BLINK		16
-#define ATTR_REVERSE		32
-#define ATTR_CONCEAL		64
-#define ATTR_STRIKE		128
+#define RENDER_MERGE_GAP	4
+#define DEF_FPS			60
+#define DEF_REP_MIN		8	/* Where the terminal is known to take REP. */
+#define TYPEAHEAD_SIZE		256	/* Keys typed while probing. */
+#define ATTR_MAX		65536	/* Interned attributes, a 16-bit index. */
+#define ATTR_HASH_SIZE		(2 * ATTR_MAX)
+
+#define HALF_BLOCK		0x2580	/* Upper half block, two pixels a cell. */
+#define RAIN_CELLS		2048	/* Most cells one tick of rain changes. */
+#define RAIN_FLIPS		16	/* Glyphs changed in place each tick. */
+#define RAIN_SHADES		4
+#define RAIN_MAX		1000	/* Ticks a second, past any frame rate. */
+
+#define CELL_WIDE		1	/* Left half of a double width character, */
+#define CELL_SPACER		2	/* and its right half. */
 
 #define STR(S) #S
 
-#define ANSIESC "\033["
-#define ANSIGOTO(X,Y) ANSIESC X ";" Y "H"
 #define ANSISCROLL(B,E) ANSIESC B ";" E "r"
 #define ANSIMARGIN(B,E) ANSIESC B ";" E "s"
 #define ANSIRESETATTR ANSIESC "0m"
+#define ANSISYNCBEGIN ANSIESC "?2026h"
+#define ANSISYNCEND ANSIESC "?2026l"
 
 typedef struct {
-	int fg;
-	int bg;
-	int attr;
-} Attr;
+	uint32_t ch;			/* Codepoint, 0 if unknown. */
+	uint16_t attr;			/* Index into the attribute table. */
+	uint16_t flags;
+} Cell;
 
 typedef struct {
-	char ch;
-	Attr attr;
-} Cell;
+	Attr *attrs;			/* Index 0 is the plain attribute. */
+	int n;
+	uint32_t *hash;			/* Open addressing on index + 1, 0 if free. */
+} AttrTable;
+
+typedef struct {
+	int w, h;
+	Cell *cells;			/* One arena of h rows of w cells. */
+	int *map;			/* Screen row to arena row. */
+	int *dirtystart, *dirtyend;	/* Per arena row, -1 if clean. */
+} Grid;
+
+/* Parser states and actions, after Paul Williams' DEC ANSI parser. */
+enum {
+	VT_GROUND,
+	VT_ESCAPE,
+	VT_ESCAPE_INTERMEDIATE,
+	VT_CSI_ENTRY,
+	VT_CSI_PARAM,
+	VT_CSI_INTERMEDIATE,
+	VT_CSI_IGNORE,
+	VT_DCS_ENTRY,
+	VT_DCS_PARAM,
+	VT_DCS_INTERMEDIATE,
+	VT_DCS_PASSTHROUGH,		/* From here on, strings we drop. */
+	VT_DCS_IGNORE,
+	VT_OSC_STRING,
+	VT_SOS_PM_APC_STRING,
+	VT_STATES
+};
+
+enum {
+	VA_NONE,			/* Also ignore, put and osc_put. */
+	VA_PRINT,
+	VA_EXECUTE,
+	VA_COLLECT,
+	VA_PARAM,
+	VA_ESC_DISPATCH,
+	VA_CSI_DISPATCH
+};
+
+#define VT_CLEAR	0x100		/* Table flag, the transition clears. */
+
+typedef struct {
+	int state;
+	int params[MAX_PARAMS];
+	int nparams;
+	unsigned int sub;		/* Bit i set if params[i] followed a ':'. */
+	int cur;			/* Parameter being collected, */
+	int started;			/* and whether there is one. */
+	char marker;			/* Private marker, one of < = > ?. */
+	char inter[MAX_INTERMEDIATES];
+	int ninter;
+	int overflow;			/* Too many intermediates, drop it. */
+	uint32_t cp;			/* UTF-8 sequence being decoded, */
+	int need;			/* the bytes it still needs */
+	uint32_t min;			/* and its smallest valid value. */
+} Parser;
+
+typedef struct {
+	char data[INPUT_QUEUE_SIZE];
+	size_t start, len;
+} Queue;
 
-typedef enum {
-	NORMAL,
-	ESC,
-	CSI
-} ParserState;
+typedef struct {
+	int head;			/* Row of the head, negative until it enters, */
+	int len;			/* how many rows it trails, */
+	int speed;			/* ticks for each row it falls, */
+	int wait;			/* and ticks left until the next. */
+} Drop;
 
 typedef struct {
 	int x, y;
 	int w, h;
 	int vrow, vcol;
 	int wrap_pending;		/* Flag for pending line wrap. */
+	uint32_t last_char;		/* Printed last, for REP, 0 if none. */
 	int saved_vrow, saved_vcol;
+	Parser parser;
 	int scroll_top, scroll_bottom;
-	Cell **buffer;
+	Grid buffer;			/* What the child has drawn. */
+	Grid shown;			/* What the outer terminal displays. */
+	Grid alt;			/* The screen not in use, */
+	int altscreen;			/* and whether it is the main one. */
+	Caps caps;			/* What the outer terminal can do, */
+	int probe;			/* and whether to ask it. */
+	long long late_until;		/* Time to stop dropping late replies, in us. */
+	int profile;			/* Print the capabilities and quit. */
+	int margins;			/* Outer terminal honours DECSLRM margins. */
+	int right_edge;			/* Region reaches the terminal's right edge, */
+	int full_width;			/* and the left one too. */
+	int forward;			/* Forward child output at full width, */
+	int lockstep;			/* and the terminal mirrors the child now, */
+	size_t forwarded;		/* with this much forwarded in this frame. */
+	int sync;			/* Outer terminal does synchronized output. */
+	int rep_min;			/* Shortest run sent with REP, 0 for never,
+					 * -1 to go by the capabilities. */
+	int margin_top, margin_bottom;	/* Outer DECSTBM margins, in region rows. */
+	int scroll_pending;		/* Lines not yet scrolled on the outer terminal, */
+	int scroll_pending_top;		/* up if positive, down if negative, */
+	int scroll_pending_bottom;	/* within these rows, */
+	int scroll_pending_attr;	/* exposing lines of this attribute. */
+	AttrTable attrs;
 	Attr current_attr;
+	int current_index;		/* Of current_attr, -1 if not interned yet. */
+	int real_attr;			/* Outer terminal's SGR state, -1 if unknown. */
+	int real_row, real_col;		/* Outer cursor, absolute, -1 if unknown. */
 	char child[CHILD_LEN];
+	const char *record;		/* Session log to write, or NULL, */
+	Recorder rec;
+	const char *replay;		/* and one to play instead of a child, */
+	int fast;			/* without waiting between reads. */
+	const char *image;		/* Background around the region, or NULL, */
+	int rain;			/* or digital rain at this many ticks a second. */
+	Grid back;			/* The background over the whole terminal, */
+	Grid back_shown;		/* and what the terminal shows of it. */
+	Drop *drops;			/* One for each column of rain, */
+	int rain_col;			/* the one the next tick starts at, */
+	int rain_attr[RAIN_SHADES];	/* its colours from the head down. */
+	uint32_t seed;
+	long long next_tick;		/* Time of the next tick, in us. */
+	int cols, rows;			/* Outer terminal size, */
+	int clip_cols, clip_rows;	/* of which it has this much after a resize. */
+	OutBuf out;			/* Output queued for the outer terminal, */
+	size_t outpos;			/* of which this much is written */
+	size_t frame_mark;		/* and this much is framed, the rest waits. */
+	int outfd;
+	int fps;			/* Frame cap, 0 for none. */
+	int changed;			/* Child output since the last frame. */
+	long long next_frame;		/* Earliest time for a frame, in us. */
+	int stats;
+	unsigned long long bytes_in, bytes_out, writes;
 } PTYState;
 
-static void move_to_real(int offset_row, int offset_col, int vrow, int vcol);
+static int out_flush(PTYState *state);
+
+static void move_to_real(PTYState *state, int vrow, int vcol);
 
 static void cleanup(void);
 
 static int set_raw_mode(int fd);
 
+static int set_nonblock(int fd, int on);
+
+static void init_state(PTYState *state);
+
 static int parse_arguments(int argc, char *argv[], struct winsize *ws, PTYState *state);
 
+static int init_screen(PTYState *state);
+
 static int initialize_pty(PTYState *state, int *master, pid_t *pid, struct winsize *ws);
 
-static void apply_attributes(Attr attr);
+static int start_replay(PTYState *state, int *master, pid_t *pid);
+
+static void feed_replay(PTYState *state, int fd);
+
+static int attr_table_init(AttrTable *t);
+
+static void attr_table_free(AttrTable *t);
+
+static unsigned int attr_hash(Attr a);
+
+static int attr_lookup(AttrTable *t, Attr a);
+
+static void attr_compact(PTYState *state);
+
+static int attr_intern(PTYState *state, Attr a);
+
+static int current_attr(PTYState *state);
+
+static void apply_attributes(PTYState *state, int attr);
+
+static int grid_init(Grid *g, int w, int h);
+
+static void grid_free(Grid *g);
+
+static Cell *grid_row(const Grid *g, int row);
+
+static void grid_clear_row(Grid *g, int row, int start_col, int end_col, int attr);
+
+static void reverse_rows(int *map, int len);
+
+static void grid_scroll(Grid *g, int top, int bottom, int n, int attr);
 
-static void redraw_line(PTYState *state, int row, int start_col, int end_col);
+static void set_dirty(PTYState *state, int row, int start_col, int end_col);
 
-static void scroll_up_pty(PTYState *state, int n);
+static void set_dirty_rows(PTYState *state, int top, int bottom);
 
-static void scroll_down_pty(PTYState *state, int n);
+static int cell_equal(const Cell *a, const Cell *b);
 
-static void reset_cell(Cell *cell);
+static int next_run(const Cell *line, const Cell *shown, int *pos, int end, int w, int *start);
+
+static void draw_run(PTYState *state, const Cell *line, Cell *shown, int start, int end);
+
+static void render(PTYState *state);
+
+static int in_region(const PTYState *state, int row, int col);
+
+static int init_back(PTYState *state);
+
+static int back_image(PTYState *state);
+
+static int init_rain(PTYState *state);
+
+static uint32_t rain_random(PTYState *state);
+
+static void drop_reset(PTYState *state, Drop *d);
+
+static uint32_t rain_glyph(PTYState *state);
+
+static void back_dirty(PTYState *state, int row, int col);
+
+static int rain_set(PTYState *state, int row, int col, int shade, int glyph);
+
+static void rain_tick(PTYState *state);
+
+static void back_move(PTYState *state, int row, int col);
+
+static int render_back(PTYState *state);
+
+static void send_margins(PTYState *state, int cols, int rows);
+
+static void redraw_screen(PTYState *state);
+
+static void on_winch(int sig);
+
+static long long now_us(void);
+
+static void present(PTYState *state);
+
+static void scroll_outer(PTYState *state, int top, int bottom, int n, int attr);
+
+static void flush_scroll(PTYState *state);
+
+static void scroll_up_pty(PTYState *state, int top, int n);
+
+static void scroll_down_pty(PTYState *state, int top, int n);
+
+static void reset_cell(Cell *cell, int attr);
+
+static int erase_attr(PTYState *state);
+
+static void split_shown(PTYState *state, int row, int col);
+
+static void erase_outer(PTYState *state, int row, int start_col, int end_col, int attr);
+
+static void shift_outer(PTYState *state, int row, int col, int n, int attr, char op);
+
+static void erase_cells(PTYState *state, int row, int start_col, int end_col);
 
 static void clear_line_to_start(PTYState *state);
 
-static void handle_normal_state(char ch, PTYState *state);
+static void try_lockstep(PTYState *state);
+
+static void sync_lockstep(PTYState *state);
+
+static void leave_lockstep(PTYState *state);
+
+static int forward_safe(PTYState *state, int action, char ch);
 
-static int handle_csi_sequence(PTYState *state, int *params, int param_count, char final_char);
+static void forward_op(PTYState *state, int action, char ch);
+
+static size_t scan_printable(const char *s, size_t n);
+
+static void wrap_line(PTYState *state);
+
+static void unpair(PTYState *state, int row, int col);
+
+static void print_run(PTYState *state, const char *s, size_t n);
+
+static void print_char(PTYState *state, uint32_t cp);
+
+static void utf8_byte(PTYState *state, unsigned char ch);
+
+static void utf8_cut(PTYState *state);
+
+static size_t print_text(PTYState *state, const char *s, size_t n);
+
+static void save_cursor(PTYState *state);
+
+static void restore_cursor(PTYState *state);
+
+static void erase_screen(PTYState *state);
+
+static void switch_screen(PTYState *state, int alt);
+
+static void handle_control(PTYState *state, char ch);
+
+static int sgr_rgb(const int *rgb);
+
+static int sgr_color(const Parser *p, int n, int *color);
+
+static int handle_csi_sequence(PTYState *state, const Parser *p, char final_char);
+
+static void set_private_modes(PTYState *state, char final_char);
+
+static void passthrough_csi(PTYState *state, char final_char);
+
+static void esc_dispatch(PTYState *state, char final_char);
+
+static void csi_dispatch(PTYState *state, char final_char);
+
+static void vt_rule(int st, int lo, int hi, int action, int next);
+
+static void vt_init(void);
+
+static void vt_clear(Parser *p);
+
+static void vt_param(Parser *p, char ch);
+
+static size_t scan_string(const char *s, size_t n);
+
+static void vt_feed(PTYState *state, const char *buf, size_t n);
+
+static int queue_read(int fd, Queue *q);
+
+static int queue_write(int fd, Queue *q);
+
+static int read_child(int master, PTYState *state, char *buff);
 
 static int process_input(int master, PTYState *state);
 
 static struct termios orig_termios;
 
+static int orig_flags[2] = { -1, -1 };	/* Of stdin and stdout. */
+
+static const Attr plain_attr = { -1, -1, 0 };
+
+static volatile sig_atomic_t winched;
+
+/* Digital rain, a pale head over greens that darken up the trail. From
+ * the palette, as its SGR is half as long as direct colour's. */
+static const Attr rain_shades[RAIN_SHADES] = {
+	{ 194, -1, 0 },
+	{ 46, -1, 0 },
+	{ 34, -1, 0 },
+	{ 22, -1, 0 },
+};
+
+static unsigned short vt_table[VT_STATES][256];
+
+static int
+out_flush(PTYState *state)
+{
+	ssize_t r;
+
+	/* Write what the terminal takes now of the frames presented, the
+	 * rest stays queued. What came since goes into the next frame. */
+	while(state->outpos < state->frame_mark) {
+		r = write(state->outfd, state->out.data + state->outpos, state->frame_mark - state->outpos);
+		if(r < 0) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN) return 0;
+			perror("write " STR(__LINE__));
+			state->out.len = state->outpos = state->frame_mark = 0;
+			return 1;
+		}
+		state->outpos += r;
+		state->bytes_out += r;
+		++state->writes;
+	}
+	if(state->frame_mark) {
+		state->out.len -= state->frame_mark;
+		memmove(state->out.data, state->out.data + state->frame_mark, state->out.len);
+		state->outpos = state->frame_mark = 0;
+	}
+	return 0;
+}
+
 static void
-move_to_real(int offset_row, int offset_col, int vrow, int vcol)
+move_to_real(PTYState *state, int vrow, int vcol)
 {
-	printf(ANSIGOTO("%d","%d"), offset_row + vrow + 1, offset_col + vcol + 1);
+	enum { NONE, VPA, CUD, LF, CUU, CHA, CR, CRCUF, CUF, CUB, BS };
+	int row, col, top, bottom, left, d, i;
+	int rmove, rcost, cmove, ccost, cost;
+
+	row = state->y + vrow;
+	col = state->x + vcol;
+	if(row == state->real_row && col == state->real_col) return;
+
+	if(state->real_row == -1) {
+		rmove = -1;
+		rcost = 0;
+	} else if(row == state->real_row) {
+		rmove = NONE;
+		rcost = 0;
+	} else {
+		/* Relative moves stop at a margin they would cross. */
+		top = state->y + state->margin_top;
+		bottom = state->y + state->margin_bottom;
+		d = row - state->real_row;
+		rmove = VPA;
+		rcost = enc_csi_len(row + 1);
+		if(d > 0 && !(state->real_row <= bottom && row > bottom)) {
+			if(d < rcost) {
+				rmove = LF;
+				rcost = d;
+			}
+			if(enc_csi_len(d) < rcost) {
+				rmove = CUD;
+				rcost = enc_csi_len(d);
+			}
+		} else if(d < 0 && !(state->real_row >= top && row < top) && enc_csi_len(-d) < rcost) {
+			rmove = CUU;
+			rcost = enc_csi_len(-d);
+		}
+	}
+
+	if(state->real_col == col) {
+		cmove = NONE;
+		ccost = 0;
+	} else {
+		/* CR goes to the left margin when the terminal has them. */
+		left = state->margins ? state->x : 0;
+		cmove = CHA;
+		ccost = enc_csi_len(col + 1);
+		if(col == left && 1 < ccost) {
+			cmove = CR;
+			ccost = 1;
+		} else if(col > left && 1 + enc_csi_len(col - left) < ccost) {
+			cmove = CRCUF;
+			ccost = 1 + enc_csi_len(col - left);
+		}
+		if(state->real_col != -1) {
+			d = col - state->real_col;
+			if(d > 0 && enc_csi_len(d) < ccost) {
+				cmove = CUF;
+				ccost = enc_csi_len(d);
+			} else if(d < 0 && -d < ccost) {
+				cmove = BS;
+				ccost = -d;
+			}
+			if(d < 0 && enc_csi_len(-d) < ccost) {
+				cmove = CUB;
+				ccost = enc_csi_len(-d);
+			}
+		}
+	}
+
+	cost = 4 + enc_numlen(row + 1) + enc_numlen(col + 1);
+	if(rmove == -1 || rcost + ccost >= cost) {
+		enc_csi2(&state->out, row + 1, col + 1, 'H');
+	} else {
+		switch(rmove) {
+		case VPA: enc_csi(&state->out, row + 1, 'd'); break;
+		case CUD: enc_csi(&state->out, row - state->real_row, 'B'); break;
+		case CUU: enc_csi(&state->out, state->real_row - row, 'A'); break;
+		case LF:
+			for(i = state->real_row; i < row; ++i) {
+				out_putc(&state->out, '\n');
+			}
+			break;
+		}
+		switch(cmove) {
+		case CHA: enc_csi(&state->out, col + 1, 'G'); break;
+		case CR: out_putc(&state->out, '\r'); break;
+		case CRCUF:
+			out_putc(&state->out, '\r');
+			enc_csi(&state->out, col - left, 'C');
+			break;
+		case CUF: enc_csi(&state->out, col - state->real_col, 'C'); break;
+		case CUB: enc_csi(&state->out, state->real_col - col, 'D'); break;
+		case BS:
+			for(i = col; i < state->real_col; ++i) {
+				out_putc(&state->out, '\b');
+			}
+			break;
+		}
+	}
+	state->real_row = row;
+	state->real_col = col;
 }
 
 static void
@@ -106,8 +545,14 @@ cleanup(void)
 	struct winsize ws;
 
 	tcsetattr(STDIN_FILENO, TCSANOW, &orig_termios);
+	if(orig_flags[0] != -1) {
+		fcntl(STDIN_FILENO, F_SETFL, orig_flags[0]);
+	}
+	if(orig_flags[1] != -1) {
+		fcntl(STDOUT_FILENO, F_SETFL, orig_flags[1]);
+	}
 	if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) >= 0) {
-		printf(ANSIESC "?69l" ANSISCROLL("1", "%d") ANSIMARGIN("1", "%d"), ws.ws_row, ws.ws_col);
+		printf(ANSIRESETATTR ANSIESC "?69l" ANSISCROLL("1", "%d") ANSIMARGIN("1", "%d"), ws.ws_row, ws.ws_col);
 		fflush(stdout);
 	}
 }
@@ -129,20 +574,84 @@ set_raw_mode(int fd)
 	return 0;
 }
 
+static int
+set_nonblock(int fd, int on)
+{
+	int flags;
+
+	if((flags = fcntl(fd, F_GETFL)) < 0) {
+		perror("fcntl " STR(__LINE__));
+		return 1;
+	}
+	if(fd <= STDOUT_FILENO && orig_flags[fd] == -1) {
+		orig_flags[fd] = flags;
+	}
+	flags = on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+	if(fcntl(fd, F_SETFL, flags) < 0) {
+		perror("fcntl " STR(__LINE__));
+		return 1;
+	}
+	return 0;
+}
+
+static void
+init_state(PTYState *state)
+{
+	state->vrow = state->vcol = state->saved_vrow = state->saved_vcol = 0;
+	state->wrap_pending = 0;
+	state->last_char = 0;
+	state->altscreen = 0;
+	state->parser.state = VT_GROUND;
+	state->parser.need = 0;
+	vt_clear(&state->parser);
+	state->current_attr = plain_attr;
+	state->current_index = -1;
+	state->out.data = NULL;
+	state->out.len = state->out.size = 0;
+	state->outpos = state->frame_mark = 0;
+	state->outfd = STDOUT_FILENO;
+	state->stats = 0;
+	state->record = state->replay = NULL;
+	state->fast = 0;
+	state->image = NULL;
+	state->rain = 0;
+	state->back.cells = state->back_shown.cells = NULL;
+	state->drops = NULL;
+	probe_defaults(&state->caps);
+	state->probe = 1;
+	state->profile = 0;
+	state->margins = 1;
+	state->right_edge = state->full_width = 0;
+	state->forward = 1;
+	state->lockstep = 0;
+	state->forwarded = 0;
+	state->sync = 1;
+	state->rep_min = -1;
+	state->fps = DEF_FPS;
+	state->changed = 0;
+	state->next_frame = 0;
+	state->real_attr = -1;
+	state->real_row = state->real_col = -1;
+	state->scroll_pending = 0;
+	state->bytes_in = state->bytes_out = state->writes = 0;
+}
+
 static int
 parse_arguments(int argc, char *argv[], struct winsize *ws, PTYState *state)
 {
 	int opt;
-	int x, y, w, h;
+	int x, y, w, h, wset, hset;
 	char c[CHILD_LEN];
+	Cast cast;
 	
 	x = DEF_MARGIN_H;
 	y = DEF_MARGIN_V;
 	w = ws->ws_col - 2*DEF_MARGIN_H;
 	h = ws->ws_row - 2*DEF_MARGIN_V;
 	strncpy(c, DEF_CHILD, CHILD_LEN-1);
+	wset = hset = 0;
 
-	while(-1 != (opt = getopt(argc, argv, "x:y:w:h:c:"))) {
+	while(-1 != (opt = getopt(argc, argv, "x:y:w:h:c:F:b:r:p:fi:D:sMSCPR"))) {
 		switch(opt) {
 		case 'x':
 			x = atoi(optarg);
@@ -152,18 +661,67 @@ parse_arguments(int argc, char *argv[], struct winsize *ws, PTYState *state)
 			break;
 		case 'w':
 			w = atoi(optarg);
+			wset = 1;
 			break;
 		case 'h':
 			h = atoi(optarg);
+			hset = 1;
 			break;
 		case 'c':
 			strncpy(c, optarg, CHILD_LEN-1);
+			break;
+		case 'F':
+			state->fps = atoi(optarg);
+			break;
+		case 'b':
+			state->rep_min = atoi(optarg);
+			break;
+		case 's':
+			state->stats = 1;
+			break;
+		case 'M':
+			state->margins = 0;
+			break;
+		case 'S':
+			state->sync = 0;
+			break;
+		case 'C':
+			state->profile = 1;
+			break;
+		case 'P':
+			state->probe = 0;
+			break;
+		case 'R':
+			state->forward = 0;
+			break;
+		case 'r':
+			state->record = optarg;
+			break;
+		case 'p':
+			state->replay = optarg;
+			break;
+		case 'f':
+			state->fast = 1;
+			break;
+		case 'i':
+			state->image = optarg;
+			break;
+		case 'D':
+			state->rain = atoi(optarg);
+			break;
 		default:
-			fprintf(stderr, "Usage: %s [-x xpos] [-y ypos] [-w width] [-h height]\nIf xpos/ypos negative, add the width/height of the terminal.\nIf width/height nonpositive, add the width/height of the terminal.\n", *argv);
+			fprintf(stderr, "Usage: %s [-x xpos] [-y ypos] [-w width] [-h height] [-c child] [-F fps] [-b run] [-s] [-M] [-S] [-C] [-P] [-R] [-r file] [-p file [-f]] [-i image | -D rate]\nIf xpos/ypos negative, add the width/height of the terminal.\nIf width/height nonpositive, add the width/height of the terminal.\n-F caps the frames drawn per second, 0 for no cap (default %d).\n-b sends runs of at least this many equal cells with REP, 0 for never\n   (default %d if the terminal is known to take REP).\n-s prints output statistics on exit.\n-M repaints on scroll instead of relying on the terminal's margins.\n-S leaves out the synchronized output brackets around frames.\n-C prints what the terminal can do and quits.\n-P does not ask the terminal, assuming margins, sync and ECH.\n-R renders full width regions too, instead of forwarding the output.\n-r records the session to file, in asciicast v2.\n-p plays a recording instead of running a child, -f as fast as it goes.\n   The region takes the recorded size unless -w or -h are given.\n-i draws a PNG over the rest of the terminal, in half blocks.\n-D animates digital rain there instead, at rate ticks a second,\n   at most %d.\n", *argv, DEF_FPS, DEF_REP_MIN, RAIN_MAX);
 			return 1;
 		}
 	}
 
+	if(state->replay && !(wset && hset)) {
+		if(cast_open(&cast, state->replay)) return 2;
+		w = (!wset && cast.width) ? cast.width : w;
+		h = (!hset && cast.height) ? cast.height : h;
+		cast_close(&cast);
+	}
+
 	if(x < 0) {
 		x += ws->ws_col;
 	}
@@ -177,10 +735,29 @@ parse_arguments(int argc, char *argv[], struct winsize *ws, PTYState *state)
 		h += ws->ws_row;
 	}
 
-	if(x < 0 || y < 0 || w < 0 || h < 0 || x + w >= ws->ws_col || y + h >= ws->ws_row) {
+	if(state->fps < 0) {
+		fprintf(stderr, "Invalid frame rate.\n");
+		return 2;
+	}
+	/* REP repeats at least once, so a run of one cannot use it. */
+	if(state->rep_min < -1 || state->rep_min == 1) {
+		fprintf(stderr, "Invalid run length.\n");
+		return 2;
+	}
+	/* Faster, and the tick interval would round to nothing. */
+	if(state->rain < 0 || state->rain > RAIN_MAX) {
+		fprintf(stderr, "Invalid rain rate.\n");
+		return 2;
+	}
+
+	if(x < 0 || y < 0 || w <= 0 || h <= 0 || x + w > ws->ws_col || y + h > ws->ws_row) {
 		fprintf(stderr, "Invalid position/size.\n");
 		return 2;
 	}
+	state->right_edge = (x + w == ws->ws_col);
+	state->full_width = (x == 0 && state->right_edge);
+	state->cols = state->clip_cols = ws->ws_col;
+	state->rows = state->clip_rows = ws->ws_row;
 
 	ws->ws_row = h;
 	ws->ws_col = w;
@@ -188,14 +765,31 @@ parse_arguments(int argc, char *argv[], struct winsize *ws, PTYState *state)
 	state->y = y;
 	state->w = w;
 	state->h = h;
-	state->scroll_top = 0;
-	state->scroll_bottom = h - 1;
-	state->current_attr.fg = state->current_attr.bg = -1;
-	state->current_attr.attr = 0;
 	strcpy(state->child, c);
 	return 0;
 }
 
+static int
+init_screen(PTYState *state)
+{
+	unsigned int i;
+
+	state->scroll_top = 0;
+	state->scroll_bottom = state->h - 1;
+	state->margin_top = 0;
+	state->margin_bottom = state->h - 1;
+	if(attr_table_init(&state->attrs) ||
+	   grid_init(&state->buffer, state->w, state->h) || grid_init(&state->shown, state->w, state->h) ||
+	   grid_init(&state->alt, state->w, state->h)) {
+		return 1;
+	}
+	/* Unknown contents, never equal to a real cell. */
+	for(i = 0; i < state->h * state->w; ++i) {
+		state->shown.cells[i].ch = 0;
+	}
+	return (state->image || state->rain > 0) ? init_back(state) : 0;
+}
+
 static int
 initialize_pty(PTYState *state, int *master, pid_t *pid, struct winsize *ws)
 {
@@ -213,218 +807,1487 @@ initialize_pty(PTYState *state, int *master, pid_t *pid, struct winsize *ws)
 	return 0;
 }
 
+static int
+start_replay(PTYState *state, int *master, pid_t *pid)
+{
+	int sv[2];
+
+	/* The recording is played by a process of its own, standing in
+	 * for the child on the other end of a socket. */
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair " STR(__LINE__));
+		return 1;
+	}
+	if((*pid = fork()) < 0) {
+		perror("fork " STR(__LINE__));
+		return 1;
+	}
+	if(*pid == 0) {
+		close(sv[0]);
+		feed_replay(state, sv[1]);
+		_exit(0);
+	}
+	close(sv[1]);
+	*master = sv[0];
+	return 0;
+}
+
 static void
-apply_attributes(Attr attr)
+feed_replay(PTYState *state, int fd)
 {
-	printf(ANSIRESETATTR);
-	if(attr.attr & ATTR_BOLD) printf(ANSIESC "1m");
-	if(attr.attr & ATTR_FAINT) printf(ANSIESC "2m");
-	if(attr.attr & ATTR_ITALIC) printf(ANSIESC "3m");
-	if(attr.attr & ATTR_UNDERLINE) printf(ANSIESC "4m");
-	if(attr.attr & ATTR_BLINK) printf(ANSIESC "5m");
-	if(attr.attr & ATTR_REVERSE) printf(ANSIESC "7m");
-	if(attr.attr & ATTR_CONCEAL) printf(ANSIESC "8m");
-	if(attr.attr & ATTR_STRIKE) printf(ANSIESC "9m");
-	if(attr.fg != -1) {
-		if(attr.fg < 8) {
-			printf(ANSIESC "3%dm", attr.fg);
-		} else if (attr.fg < 16) {
-			printf(ANSIESC "9%dm", attr.fg - 8);
-		} else {
-			printf(ANSIESC "38;5;%dm", attr.fg);
+	struct pollfd pfd;
+	Cast cast;
+	double t;
+	char type, key;
+	size_t n, off;
+	ssize_t r;
+	long long start, wait;
+
+	if(cast_open(&cast, state->replay)) return;
+	start = now_us();
+	while(cast_next(&cast, &t, &type, &n)) {
+		if(type != 'o') continue;
+		/* Keys are not played, but a C-C stops the playing. */
+		while(!state->fast && (wait = start + (long long)(t * 1e6) - now_us()) > 0) {
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			if(poll(&pfd, 1, (wait + 999) / 1000) > 0 &&
+			   (read(fd, &key, 1) <= 0 || key == 3)) {
+				cast_close(&cast);
+				return;
+			}
 		}
-	}
-	if(attr.bg != -1) {
-		if(attr.bg < 8) {
-			printf(ANSIESC "4%dm", attr.bg);
-		} else if (attr.bg < 16) {
-			printf(ANSIESC "10%dm", attr.bg - 8);
-		} else {
-			printf(ANSIESC "48;5;%dm", attr.bg);
+		for(off = 0; off < n; off += r) {
+			if((r = write(fd, cast.buf + off, n - off)) < 0) {
+				if(errno == EINTR) {
+					r = 0;
+					continue;
+				}
+				cast_close(&cast);
+				return;
+			}
 		}
 	}
+	cast_close(&cast);
+}
+
+static int
+attr_table_init(AttrTable *t)
+{
+	t->attrs = (Attr *)malloc(ATTR_MAX * sizeof(Attr));
+	t->hash = (uint32_t *)calloc(ATTR_HASH_SIZE, sizeof(uint32_t));
+	if(!t->attrs || !t->hash) {
+		perror("malloc " STR(__LINE__));
+		return 1;
+	}
+	t->n = 0;
+	attr_lookup(t, plain_attr);
+	return 0;
 }
 
 static void
-redraw_line(PTYState *state, int row, int start_col, int end_col)
+attr_table_free(AttrTable *t)
 {
-	Attr last_attr;
-	unsigned int i;
-	Cell *cell;
+	free(t->attrs);
+	free(t->hash);
+}
 
-	if(start_col < 0) {
-		start_col = 0;
-	}
-	if(end_col >= state->w) {
-		end_col = state->w - 1;
-	}
-	if(start_col > end_col) return;
+static unsigned int
+attr_hash(Attr a)
+{
+	unsigned int h;
 
-	move_to_real(state->x, state->y, row, start_col);
-	last_attr.fg = last_attr.bg = -2;
-	last_attr.attr = -1;
-	for(i = start_col; i <= end_col; ++i) {
-		cell = state->buffer[row] + i;
-		
-		if(memcmp(&last_attr, &cell->attr, sizeof(Attr))) {
-			last_attr = cell->attr;
-			apply_attributes(last_attr);
+	h = (unsigned int)a.fg * 0x9e3779b1u ^ (unsigned int)a.bg * 0x85ebca6bu ^ (unsigned int)a.attr * 0xc2b2ae35u;
+	return (h ^ h >> 15) & (ATTR_HASH_SIZE - 1);
+}
+
+static int
+attr_lookup(AttrTable *t, Attr a)
+{
+	unsigned int h;
+	Attr *e;
+
+	for(h = attr_hash(a); t->hash[h]; h = (h + 1) & (ATTR_HASH_SIZE - 1)) {
+		e = t->attrs + t->hash[h] - 1;
+		if(e->fg == a.fg && e->bg == a.bg && e->attr == a.attr) {
+			return t->hash[h] - 1;
 		}
-		putchar(cell->ch);
 	}
-	printf(ANSIRESETATTR);
-	move_to_real(state->x, state->y, state->vrow, state->vcol);
-	fflush(stdout);
+	if(t->n == ATTR_MAX) return -1;
+	t->attrs[t->n] = a;
+	t->hash[h] = ++t->n;
+	return t->n - 1;
 }
 
 static void
-scroll_up_pty(PTYState *state, int n)
+attr_compact(PTYState *state)
 {
-	unsigned int i, j;
-	Cell *row;
+	Grid *grids[5] = { &state->buffer, &state->shown, &state->alt, &state->back, &state->back_shown };
+	AttrTable *t = &state->attrs;
+	Attr *old;
+	int *remap;
+	size_t i, n;
+	int g, ngrids;
+
+	/* Keep what is on any grid, renumbered from scratch. */
+	old = (Attr *)malloc(ATTR_MAX * sizeof(Attr));
+	remap = (int *)malloc(ATTR_MAX * sizeof(int));
+	if(!old || !remap) {
+		perror("malloc " STR(__LINE__));
+		exit(1);
+	}
+	memcpy(old, t->attrs, t->n * sizeof(Attr));
+	memset(remap, -1, ATTR_MAX * sizeof(int));
+	remap[0] = 0;
+	ngrids = state->back.cells ? 5 : 3;
+	for(g = 0; g < ngrids; ++g) {
+		n = (size_t)grids[g]->w * grids[g]->h;
+		for(i = 0; i < n; ++i) {
+			remap[grids[g]->cells[i].attr] = 0;
+		}
+	}
+	if(state->real_attr >= 0) {
+		remap[state->real_attr] = 0;
+	}
+	if(state->scroll_pending) {
+		remap[state->scroll_pending_attr] = 0;
+	}
 
+	n = t->n;
+	t->n = 0;
+	memset(t->hash, 0, ATTR_HASH_SIZE * sizeof(uint32_t));
 	for(i = 0; i < n; ++i) {
-		row = state->buffer[state->scroll_top];
-		for(j = state->scroll_top; j < state->scroll_bottom; ++j) {
-			state->buffer[j] = state->buffer[j + 1];
+		if(remap[i] != -1) {
+			remap[i] = attr_lookup(t, old[i]);
 		}
-		state->buffer[j] = row;
+	}
 
-		for(j = 0; j < state->w; ++j) {
-			state->buffer[state->scroll_bottom][j].ch = ' ';
-			state->buffer[state->scroll_bottom][j].attr.fg = -1;
-			state->buffer[state->scroll_bottom][j].attr.bg = -1;
-			state->buffer[state->scroll_bottom][j].attr.attr = 0;
+	for(g = 0; g < ngrids; ++g) {
+		n = (size_t)grids[g]->w * grids[g]->h;
+		for(i = 0; i < n; ++i) {
+			grids[g]->cells[i].attr = remap[grids[g]->cells[i].attr];
+		}
+	}
+	if(state->real_attr >= 0) {
+		state->real_attr = remap[state->real_attr];
+	}
+	if(state->scroll_pending) {
+		state->scroll_pending_attr = remap[state->scroll_pending_attr];
+	}
+	if(state->drops) {
+		for(g = 0; g < RAIN_SHADES; ++g) {
+			state->rain_attr[g] = attr_lookup(t, rain_shades[g]);
 		}
 	}
+	state->current_index = -1;
+	free(old);
+	free(remap);
+}
+
+static int
+attr_intern(PTYState *state, Attr a)
+{
+	int i;
+
+	if((i = attr_lookup(&state->attrs, a)) >= 0) return i;
+	attr_compact(state);
+	/* With every entry on screen, fall back to plain. */
+	i = attr_lookup(&state->attrs, a);
+	return (i >= 0) ? i : 0;
+}
 
-	for(i = state->scroll_top; i <= state->scroll_bottom; ++i) {
-		redraw_line(state, i, 0, state->w - 1);
+static int
+current_attr(PTYState *state)
+{
+	if(state->current_index < 0) {
+		state->current_index = attr_intern(state, state->current_attr);
 	}
+	return state->current_index;
 }
 
 static void
-scroll_down_pty(PTYState *state, int n)
+apply_attributes(PTYState *state, int attr)
 {
-	unsigned int i, j;
-	Cell *row;
+	static const Attr unknown = { -2, -2, -1 };
 
-	for(i = 0; i < n; ++i) {
-		row = state->buffer[state->scroll_bottom];
-		for(j = state->scroll_bottom; j > state->scroll_top; --j) {
-			state->buffer[j] = state->buffer[j - 1];
-		}
-		state->buffer[j] = row;
+	if(attr == state->real_attr) return;
+	enc_sgr(&state->out, (state->real_attr < 0) ? unknown : state->attrs.attrs[state->real_attr],
+	        state->attrs.attrs[attr]);
+	state->real_attr = attr;
+}
 
-		for(j = 0; j < state->w; ++j) {
-			state->buffer[state->scroll_bottom][j].ch = ' ';
-			state->buffer[state->scroll_bottom][j].attr.fg = -1;
-			state->buffer[state->scroll_bottom][j].attr.bg = -1;
-			state->buffer[state->scroll_bottom][j].attr.attr = 0;
-		}
+static int
+grid_init(Grid *g, int w, int h)
+{
+	int i;
+
+	g->w = w;
+	g->h = h;
+	g->cells = (Cell *)malloc((size_t)w * h * sizeof(Cell));
+	g->map = (int *)malloc(h * sizeof(int));
+	g->dirtystart = (int *)malloc(h * sizeof(int));
+	g->dirtyend = (int *)malloc(h * sizeof(int));
+	if(!g->cells || !g->map || !g->dirtystart || !g->dirtyend) {
+		perror("malloc " STR(__LINE__));
+		return 1;
 	}
-
-	for(i = state->scroll_top; i <= state->scroll_bottom; ++i) {
-		redraw_line(state, i, 0, state->w - 1);
+	for(i = 0; i < h; ++i) {
+		g->map[i] = i;
+		g->dirtystart[i] = g->dirtyend[i] = -1;
+		grid_clear_row(g, i, 0, w - 1, 0);
 	}
+	return 0;
 }
 
 static void
-reset_cell(Cell *cell)
+grid_free(Grid *g)
 {
-	cell->ch = ' ';
-	cell->attr.fg = cell->attr.bg = -1;
-	cell->attr.attr = 0;
+	free(g->cells);
+	free(g->map);
+	free(g->dirtystart);
+	free(g->dirtyend);
 }
 
-static void
-clear_line_to_start(PTYState *state)
+static Cell *
+grid_row(const Grid *g, int row)
 {
-	unsigned int i;
-
-	for(i = 0; i <= state->vcol; ++i) {
-		reset_cell(state->buffer[state->vrow] + i);
-	}
-	move_to_real(state->x, state->y, state->vrow, 0);
-	apply_attributes(state->current_attr);
-	for(i = 0; i <= state->vcol; ++i) {
-		putchar(' ');
-	}
-	state->vcol = 0;
-	move_to_real(state->x, state->y, state->vrow, state->vcol);
-	fflush(stdout);
+	return g->cells + (size_t)g->map[row] * g->w;
 }
 
 static void
-handle_normal_state(char ch, PTYState *state)
+grid_clear_row(Grid *g, int row, int start_col, int end_col, int attr)
 {
-	switch(ch) {
-	case '\n':
+	Cell *cell;
+	int i;
+
+	cell = grid_row(g, row);
+	for(i = start_col; i <= end_col; ++i) {
+		reset_cell(cell + i, attr);
+	}
+}
+
+static void
+reverse_rows(int *map, int len)
+{
+	int i, t;
+
+	for(i = 0; i < len / 2; ++i) {
+		t = map[i];
+		map[i] = map[len - 1 - i];
+		map[len - 1 - i] = t;
+	}
+}
+
+static void
+grid_scroll(Grid *g, int top, int bottom, int n, int attr)
+{
+	int len, i, first, last;
+
+	len = bottom - top + 1;
+	if(n >= len || -n >= len) {
+		first = top;
+		last = bottom;
+	} else {
+		/* Rotate the region's row map by n, up if positive, so the
+		 * arena rows that fall off one side come around the other. */
+		i = (n > 0) ? n : len + n;
+		reverse_rows(g->map + top, i);
+		reverse_rows(g->map + top + i, len - i);
+		reverse_rows(g->map + top, len);
+		first = (n > 0) ? bottom - n + 1 : top;
+		last = (n > 0) ? bottom : top - n - 1;
+	}
+	for(i = first; i <= last; ++i) {
+		grid_clear_row(g, i, 0, g->w - 1, attr);
+		g->dirtystart[g->map[i]] = g->dirtyend[g->map[i]] = -1;
+	}
+}
+
+static void
+set_dirty(PTYState *state, int row, int start_col, int end_col)
+{
+	if(row < 0 || row >= state->h) return;
+	if(start_col < 0) {
+		start_col = 0;
+	}
+	if(end_col >= state->w) {
+		end_col = state->w - 1;
+	}
+	if(start_col > end_col) return;
+
+	row = state->buffer.map[row];
+	if(state->buffer.dirtystart[row] == -1 || start_col < state->buffer.dirtystart[row]) {
+		state->buffer.dirtystart[row] = start_col;
+	}
+	if(state->buffer.dirtyend[row] == -1 || end_col > state->buffer.dirtyend[row]) {
+		state->buffer.dirtyend[row] = end_col;
+	}
+}
+
+static void
+set_dirty_rows(PTYState *state, int top, int bottom)
+{
+	int i;
+
+	for(i = top; i <= bottom; ++i) {
+		set_dirty(state, i, 0, state->w - 1);
+	}
+}
+
+static int
+cell_equal(const Cell *a, const Cell *b)
+{
+	return a->ch == b->ch && a->attr == b->attr && a->flags == b->flags;
+}
+
+static int
+next_run(const Cell *line, const Cell *shown, int *pos, int end, int w, int *start)
+{
+	int i, gap;
+
+	/* Skip cells the outer terminal already shows. */
+	for(i = *pos; i <= end && cell_equal(line + i, shown + i); ++i);
+	if(i > end) {
+		*pos = i;
+		return 0;
+	}
+
+	/* Extend the run, absorbing short runs of equal cells, which are
+	 * cheaper to repaint than to jump over. */
+	*start = i;
+	gap = 0;
+	while(i <= end && gap <= RENDER_MERGE_GAP) {
+		if(cell_equal(line + i, shown + i)) {
+			++gap;
+		} else {
+			gap = 0;
+		}
+		++i;
+	}
+	i -= gap;
+	/* Double width characters go out whole. */
+	if(*start > 0 && line[*start].flags & CELL_SPACER) {
+		--*start;
+	}
+	if(line[i - 1].flags & CELL_WIDE && i < w) {
+		++i;
+	}
+	*pos = i;
+	return 1;
+}
+
+static void
+draw_run(PTYState *state, const Cell *line, Cell *shown, int start, int end)
+{
+	int run;
+
+	/* The cells from start up to end, at the cursor. */
+	while(start < end) {
+		run = 1;
+		if(!(line[start].flags & CELL_SPACER)) {
+			apply_attributes(state, line[start].attr);
+			out_char(&state->out, line[start].ch);
+			/* A long run of one character goes out as REP. Until
+			 * the capabilities decide, -1 means never too. Only
+			 * after ASCII: tmux, for one, repeats nothing else. */
+			if(state->rep_min > 1 && line[start].ch < 0x80) {
+				while(start + run < end && cell_equal(line + start + run, line + start)) {
+					++run;
+				}
+				if(run >= state->rep_min) {
+					enc_csi(&state->out, run - 1, 'b');
+				} else {
+					run = 1;
+				}
+			}
+		}
+		memcpy(shown + start, line + start, run * sizeof(Cell));
+		start += run;
+	}
+}
+
+static void
+render(PTYState *state)
+{
+	int row, arow, i, start, end;
+	Cell *line, *shown;
+
+	flush_scroll(state);
+
+	for(row = 0; row < state->h; ++row) {
+		arow = state->buffer.map[row];
+		if(state->buffer.dirtystart[arow] == -1) continue;
+		end = state->buffer.dirtyend[arow];
+		i = state->buffer.dirtystart[arow];
+		state->buffer.dirtystart[arow] = state->buffer.dirtyend[arow] = -1;
+		line = grid_row(&state->buffer, row);
+		shown = grid_row(&state->shown, row);
+
+		while(next_run(line, shown, &i, end, state->w, &start)) {
+			move_to_real(state, row, start);
+			draw_run(state, line, shown, start, i);
+			/* At the right edge the terminal may hold a pending wrap. */
+			state->real_col = (i == state->w) ? -1 : state->x + i;
+		}
+	}
+	move_to_real(state, state->vrow, state->vcol);
+}
+
+static int
+in_region(const PTYState *state, int row, int col)
+{
+	return row >= state->y && row < state->y + state->h && col >= state->x && col < state->x + state->w;
+}
+
+static int
+init_back(PTYState *state)
+{
+	Cell *shown;
+	int row, col;
+
+	/* The terminal shows we know not what around the region. Cells
+	 * of the region itself are blank in both grids, and never drawn
+	 * anyway, see render_back(). */
+	if(grid_init(&state->back, state->cols, state->rows) ||
+	   grid_init(&state->back_shown, state->cols, state->rows)) {
+		return 1;
+	}
+	for(row = 0; row < state->rows; ++row) {
+		shown = grid_row(&state->back_shown, row);
+		for(col = 0; col < state->cols; ++col) {
+			if(!in_region(state, row, col)) {
+				shown[col].ch = 0;
+			}
+		}
+		state->back.dirtystart[row] = 0;
+		state->back.dirtyend[row] = state->cols - 1;
+	}
+	return (state->rain > 0) ? init_rain(state) : back_image(state);
+}
+
+static int
+back_image(PTYState *state)
+{
+	Image img, scaled;
+	Cell *cell;
+	Attr a;
+	const unsigned char *top, *bottom;
+	int row, col;
+
+	/* The image stretched to the terminal, two pixels to a cell: the
+	 * upper one the foreground of a half block, the lower one its
+	 * background. */
+	if(img_load(&img, state->image)) return 1;
+	if(img_scale(&scaled, &img, state->cols, state->rows * 2)) {
+		img_free(&img);
+		return 1;
+	}
+	img_free(&img);
+	for(row = 0; row < state->rows; ++row) {
+		cell = grid_row(&state->back, row);
+		for(col = 0; col < state->cols; ++col) {
+			if(in_region(state, row, col)) continue;
+			top = scaled.rgb + ((size_t)row * 2 * state->cols + col) * 3;
+			bottom = top + (size_t)state->cols * 3;
+			a.fg = COLOR_RGB | top[0] << 16 | top[1] << 8 | top[2];
+			a.bg = COLOR_RGB | bottom[0] << 16 | bottom[1] << 8 | bottom[2];
+			a.attr = 0;
+			cell[col].ch = HALF_BLOCK;
+			cell[col].attr = attr_intern(state, a);
+		}
+	}
+	img_free(&scaled);
+	return 0;
+}
+
+static int
+init_rain(PTYState *state)
+{
+	int i;
+
+	/* Blank to start with, the drops come in from above at once. */
+	if(!(state->drops = (Drop *)malloc(state->cols * sizeof(Drop)))) {
+		perror("malloc " STR(__LINE__));
+		return 1;
+	}
+	state->seed = (uint32_t)now_us() | 1;
+	for(i = 0; i < RAIN_SHADES; ++i) {
+		state->rain_attr[i] = attr_intern(state, rain_shades[i]);
+	}
+	for(i = 0; i < state->cols; ++i) {
+		drop_reset(state, state->drops + i);
+	}
+	state->rain_col = 0;
+	state->next_tick = 0;
+	return 0;
+}
+
+static uint32_t
+rain_random(PTYState *state)
+{
+	/* xorshift32, plenty for rain. */
+	state->seed ^= state->seed << 13;
+	state->seed ^= state->seed >> 17;
+	state->seed ^= state->seed << 5;
+	return state->seed;
+}
+
+static void
+drop_reset(PTYState *state, Drop *d)
+{
+	d->head = -1 - (int)(rain_random(state) % state->rows);
+	d->len = state->rows / 4 + rain_random(state) % (state->rows / 2 + 1);
+	d->speed = 1 + rain_random(state) % 3;
+	d->wait = d->speed;
+}
+
+static uint32_t
+rain_glyph(PTYState *state)
+{
+	/* Half width katakana and digits, as in the film. */
+	if(rain_random(state) % 4) {
+		return 0xff66 + rain_random(state) % 56;
+	}
+	return '0' + rain_random(state) % 10;
+}
+
+static void
+back_dirty(PTYState *state, int row, int col)
+{
+	if(state->back.dirtystart[row] == -1 || col < state->back.dirtystart[row]) {
+		state->back.dirtystart[row] = col;
+	}
+	if(col > state->back.dirtyend[row]) {
+		state->back.dirtyend[row] = col;
+	}
+}
+
+static int
+rain_set(PTYState *state, int row, int col, int shade, int glyph)
+{
+	Cell *cell;
+
+	/* Shade -1 is blank, and a glyph only replaces the character. */
+	if(row < 0 || row >= state->rows || in_region(state, row, col)) return 0;
+	cell = grid_row(&state->back, row) + col;
+	if(shade < 0) {
+		reset_cell(cell, 0);
+	} else {
+		if(glyph || cell->ch == ' ') {
+			cell->ch = rain_glyph(state);
+		}
+		cell->attr = state->rain_attr[shade];
+	}
+	back_dirty(state, row, col);
+	return 1;
+}
+
+static void
+rain_tick(PTYState *state)
+{
+	Drop *d;
+	Cell *cell;
+	int budget, n, col, row, h;
+
+	/* Each drop that is due falls a row: a new head, the old one and
+	 * the points where the trail darkens change shade, and the end
+	 * of the trail goes blank. That is at most five cells a drop, and
+	 * no more than RAIN_CELLS a tick, the rest of the columns waiting
+	 * for the next one, which starts where this one stopped. */
+	budget = RAIN_CELLS;
+	for(n = 0; n < state->cols && budget >= 5; ++n) {
+		col = state->rain_col;
+		state->rain_col = (col + 1 < state->cols) ? col + 1 : 0;
+		d = state->drops + col;
+		if(--d->wait > 0) continue;
+		d->wait = d->speed;
+		h = ++d->head;
+		if(h - d->len >= state->rows) {
+			drop_reset(state, d);
+			continue;
+		}
+		budget -= rain_set(state, h, col, 0, 1);
+		budget -= rain_set(state, h - 1, col, 1, 0);
+		budget -= rain_set(state, h - d->len / 3, col, 2, 0);
+		budget -= rain_set(state, h - d->len * 2 / 3, col, 3, 0);
+		budget -= rain_set(state, h - d->len, col, -1, 0);
+	}
+	/* A few lit cells change their glyph in place. */
+	for(n = 0; n < RAIN_FLIPS && budget > 0; ++n) {
+		row = rain_random(state) % state->rows;
+		col = rain_random(state) % state->cols;
+		cell = grid_row(&state->back, row) + col;
+		if(cell->ch != ' ' && cell->attr != state->rain_attr[0]) {
+			cell->ch = rain_glyph(state);
+			back_dirty(state, row, col);
+			--budget;
+		}
+	}
+}
+
+static void
+back_move(PTYState *state, int row, int col)
+{
+	/* Forward along the row where that is shorter, and where it does
+	 * not cross the region's right margin, at which CUF would stop. */
+	if(state->real_row == row && state->real_col >= 0 && col >= state->real_col &&
+	   (!state->margins || col < state->x + state->w || state->real_col >= state->x + state->w)) {
+		if(col > state->real_col) {
+			enc_csi(&state->out, col - state->real_col, 'C');
+		}
+	} else {
+		enc_csi2(&state->out, row + 1, col + 1, 'H');
+	}
+	state->real_row = row;
+	state->real_col = col;
+}
+
+static int
+render_back(PTYState *state)
+{
+	int row, i, start, end, stop, seg, drawn, beside, split, right;
+	Cell *line, *shown;
+
+	/* Rows beside the region are drawn in two pieces, so that no run
+	 * reaches across it. With DECSLRM the others are split at the right
+	 * margin as well, since text printed up to it wraps there. The
+	 * cursor is left outside the margins, so afterwards it is taken to
+	 * be unknown. */
+	right = state->x + state->w;
+	split = state->margins && right < state->cols;
+	drawn = 0;
+	state->real_row = state->real_col = -1;
+	for(row = 0; row < state->clip_rows; ++row) {
+		if(state->back.dirtystart[row] == -1) continue;
+		line = grid_row(&state->back, row);
+		shown = grid_row(&state->back_shown, row);
+		beside = row >= state->y && row < state->y + state->h;
+		for(seg = 0; seg < 2; ++seg) {
+			i = state->back.dirtystart[row];
+			end = (state->back.dirtyend[row] < state->clip_cols) ? state->back.dirtyend[row] : state->clip_cols - 1;
+			if(seg) {
+				if(!beside && !split) break;
+				i = (i > right) ? i : right;
+			} else if(beside || split) {
+				stop = (beside ? state->x : right) - 1;
+				end = (end < stop) ? end : stop;
+			}
+			while(next_run(line, shown, &i, end, state->cols, &start)) {
+				back_move(state, row, start);
+				draw_run(state, line, shown, start, i);
+				/* At the right margin or edge a wrap may be pending. */
+				state->real_col = (i >= state->clip_cols || (split && i == right)) ? -1 : i;
+				drawn = 1;
+			}
+		}
+		state->back.dirtystart[row] = state->back.dirtyend[row] = -1;
+	}
+	state->real_row = state->real_col = -1;
+	return drawn;
+}
+
+static void
+send_margins(PTYState *state, int cols, int rows)
+{
+	int right, bottom;
+
+	/* The region's, as far as a terminal of cols by rows has it. */
+	right = (state->x + state->w < cols) ? state->x + state->w : cols;
+	bottom = (state->y + state->h < rows) ? state->y + state->h : rows;
+	if(state->margins) {
+		out_str(&state->out, ANSIESC "?69h");
+		enc_csi2(&state->out, state->x + 1, right, 's');
+	}
+	enc_csi2(&state->out, state->y + 1, bottom, 'r');
+	state->margin_top = 0;
+	state->margin_bottom = state->h - 1;
+	state->real_row = state->real_col = -1;
+}
+
+static void
+redraw_screen(PTYState *state)
+{
+	struct winsize ws;
+	Cell *shown;
+	size_t i, n;
+	int row, col;
+
+	/* The terminal may show anything now: all of it is drawn again. */
+	if(state->lockstep) {
+		leave_lockstep(state);
+	}
+	/* A resize resets the terminal's margins, and the region may no
+	 * longer reach its right edge, or fit at all. Scrolls not yet
+	 * sent are dropped, as the whole region is drawn again anyway. */
+	if(ioctl(state->outfd, TIOCGWINSZ, &ws) < 0 || !ws.ws_col || !ws.ws_row) {
+		ws.ws_col = state->cols;
+		ws.ws_row = state->rows;
+	}
+	state->right_edge = (state->x + state->w == ws.ws_col && state->y + state->h <= ws.ws_row);
+	state->full_width = (state->x == 0 && state->right_edge);
+	state->scroll_pending = 0;
+	send_margins(state, ws.ws_col, ws.ws_row);
+	n = (size_t)state->w * state->h;
+	for(i = 0; i < n; ++i) {
+		state->shown.cells[i].ch = 0;
+	}
+	set_dirty_rows(state, 0, state->h - 1);
+	if(state->back.cells) {
+		for(row = 0; row < state->rows; ++row) {
+			shown = grid_row(&state->back_shown, row);
+			for(col = 0; col < state->cols; ++col) {
+				if(!in_region(state, row, col)) {
+					shown[col].ch = 0;
+				}
+			}
+			state->back.dirtystart[row] = 0;
+			state->back.dirtyend[row] = state->cols - 1;
+		}
+		/* What a smaller terminal has no room for is left out. */
+		state->clip_rows = (ws.ws_row < state->rows) ? ws.ws_row : state->rows;
+		state->clip_cols = (ws.ws_col < state->cols) ? ws.ws_col : state->cols;
+	}
+	state->real_row = state->real_col = -1;
+	state->real_attr = -1;
+	state->changed = 1;
+}
+
+static void
+on_winch(int sig)
+{
+	(void)sig;
+	winched = 1;
+}
+
+static long long
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void
+present(PTYState *state)
+{
+	size_t start, mark, n;
+	char *p;
+	int drawn;
+
+	/* The brackets only go around frames that draw something, and
+	 * also around what was queued while parsing since the last one. */
+	start = state->frame_mark;
+	if(state->sync) {
+		n = sizeof(ANSISYNCBEGIN) - 1;
+		out_reserve(&state->out, n);
+		p = state->out.data + start;
+		memmove(p + n, p, state->out.len - start);
+		memcpy(p, ANSISYNCBEGIN, n);
+		state->out.len += n;
+	}
+	mark = state->out.len;
+	/* The background goes first, the region's frame leaves the cursor. */
+	drawn = state->back.cells && render_back(state);
+	if(drawn && state->lockstep) {
+		/* The grids catch up with what was forwarded, but the cursor
+		 * is out in the background now, not where the child left it. */
+		leave_lockstep(state);
+		state->real_row = state->real_col = -1;
+	}
+	if(state->lockstep) {
+		/* All went out as the child sent it, only the grids catch up. */
+		sync_lockstep(state);
+	} else {
+		render(state);
+		/* The child's attributes back, so that it may go on alone. */
+		if(drawn && state->forward && state->full_width) {
+			apply_attributes(state, current_attr(state));
+		}
+		try_lockstep(state);
+	}
+	state->forwarded = 0;
+	if(state->out.len == mark && mark == start + (state->sync ? sizeof(ANSISYNCBEGIN) - 1 : 0)) {
+		state->out.len = start;
+	} else if(state->sync) {
+		out_str(&state->out, ANSISYNCEND);
+	}
+	state->frame_mark = state->out.len;
+	state->changed = 0;
+	if(state->fps) {
+		state->next_frame = now_us() + 1000000 / state->fps;
+	}
+}
+
+static void
+scroll_outer(PTYState *state, int top, int bottom, int n, int attr)
+{
+	if(state->lockstep) {
+		grid_scroll(&state->shown, top, bottom, n, attr);
+		return;
+	}
+	/* Whole lines scroll right without left and right margins. */
+	if(!state->margins && !state->full_width) {
+		set_dirty_rows(state, top, bottom);
+		return;
+	}
+
+	/* Consecutive scrolls of one region in one direction go out as one. */
+	if(state->scroll_pending &&
+	   (state->scroll_pending_top != top || state->scroll_pending_bottom != bottom ||
+	    (state->scroll_pending > 0) != (n > 0) || state->scroll_pending_attr != attr)) {
+		flush_scroll(state);
+	}
+	state->scroll_pending_top = top;
+	state->scroll_pending_bottom = bottom;
+	state->scroll_pending_attr = attr;
+	state->scroll_pending += n;
+}
+
+static void
+flush_scroll(PTYState *state)
+{
+	int n, top, bottom;
+
+	n = state->scroll_pending;
+	top = state->scroll_pending_top;
+	bottom = state->scroll_pending_bottom;
+	if(!n) return;
+	state->scroll_pending = 0;
+
+	if(abs(n) > bottom - top) {
+		/* Nothing survives, painting is all there is. */
+		set_dirty_rows(state, top, bottom);
+		return;
+	}
+
+	if(top != state->margin_top || bottom != state->margin_bottom) {
+		enc_csi2(&state->out, state->y + top + 1, state->y + bottom + 1, 'r');
+		state->real_row = state->real_col = -1;
+		state->margin_top = top;
+		state->margin_bottom = bottom;
+	}
+	/* Exposed lines take the current background. */
+	apply_attributes(state, state->scroll_pending_attr);
+	if(n > 0) {
+		enc_csi(&state->out, n, 'S');
+	} else {
+		enc_csi(&state->out, -n, 'T');
+	}
+
+	/* Mirror the terminal: shift shown rows, exposed ones are blank. */
+	grid_scroll(&state->shown, top, bottom, n, state->scroll_pending_attr);
+}
+
+static void
+scroll_up_pty(PTYState *state, int top, int n)
+{
+	int attr;
+
+	if(n > state->scroll_bottom - top + 1) {
+		n = state->scroll_bottom - top + 1;
+	}
+	attr = erase_attr(state);
+	grid_scroll(&state->buffer, top, state->scroll_bottom, n, attr);
+	scroll_outer(state, top, state->scroll_bottom, n, attr);
+}
+
+static void
+scroll_down_pty(PTYState *state, int top, int n)
+{
+	int attr;
+
+	if(n > state->scroll_bottom - top + 1) {
+		n = state->scroll_bottom - top + 1;
+	}
+	attr = erase_attr(state);
+	grid_scroll(&state->buffer, top, state->scroll_bottom, -n, attr);
+	scroll_outer(state, top, state->scroll_bottom, -n, attr);
+}
+
+static void
+reset_cell(Cell *cell, int attr)
+{
+	cell->ch = ' ';
+	cell->attr = attr;
+	cell->flags = 0;
+}
+
+static int
+erase_attr(PTYState *state)
+{
+	/* Erased cells keep the background and nothing else (BCE). */
+	return attr_intern(state, (Attr){ -1, state->current_attr.bg, 0 });
+}
+
+static void
+split_shown(PTYState *state, int row, int col)
+{
+	Cell *cell;
+
+	/* The terminal is about to cut the shown row at col. A double width
+	 * character across the cut ends up in a state we do not model, so
+	 * forget it and let the renderer paint both halves again. */
+	if(col <= 0 || col >= state->w) return;
+	cell = grid_row(&state->shown, row) + col;
+	if(!(cell->flags & CELL_SPACER)) return;
+	cell[-1].ch = cell[0].ch = 0;
+	cell[-1].flags = cell[0].flags = 0;
+	set_dirty(state, row, col - 1, col);
+}
+
+static void
+erase_outer(PTYState *state, int row, int start_col, int end_col, int attr)
+{
+	Cell *shown;
+	int i;
+
+	/* ECH stops at the end of the line and ignores the margins, so one
+	 * serves EL and ED too. What is blank already is not erased again. */
+	if(!state->caps.ech || state->lockstep) return;
+	flush_scroll(state);
+	shown = grid_row(&state->shown, row);
+	while(start_col <= end_col && shown[start_col].ch == ' ' &&
+	      shown[start_col].attr == attr && !shown[start_col].flags) {
+		++start_col;
+	}
+	while(end_col >= start_col && shown[end_col].ch == ' ' &&
+	      shown[end_col].attr == attr && !shown[end_col].flags) {
+		--end_col;
+	}
+	if(start_col > end_col) return;
+
+	split_shown(state, row, start_col);
+	split_shown(state, row, end_col + 1);
+	move_to_real(state, row, start_col);
+	apply_attributes(state, attr);
+	enc_csi(&state->out, end_col - start_col + 1, 'X');
+	for(i = start_col; i <= end_col; ++i) {
+		reset_cell(shown + i, attr);
+	}
+}
+
+static void
+shift_outer(PTYState *state, int row, int col, int n, int attr, char op)
+{
+	Cell *shown;
+	int i, w;
+
+	/* ICH and DCH shift up to the right margin, which is only the
+	 * region's edge if the terminal takes DECSLRM or it is the
+	 * terminal's edge anyway. */
+	if(!(state->margins || state->right_edge) || !state->caps.ech || state->lockstep) return;
+	w = state->w;
+	flush_scroll(state);
+	split_shown(state, row, col);
+	split_shown(state, row, (op == '@') ? w - n : col + n);
+	move_to_real(state, row, col);
+	apply_attributes(state, attr);
+	enc_csi(&state->out, n, op);
+
+	shown = grid_row(&state->shown, row);
+	if(op == '@') {
+		memmove(shown + col + n, shown + col, (w - col - n) * sizeof(Cell));
+		for(i = col; i < col + n; ++i) {
+			reset_cell(shown + i, attr);
+		}
+	} else {
+		memmove(shown + col, shown + col + n, (w - col - n) * sizeof(Cell));
+		for(i = w - n; i < w; ++i) {
+			reset_cell(shown + i, attr);
+		}
+	}
+}
+
+static void
+erase_cells(PTYState *state, int row, int start_col, int end_col)
+{
+	int attr;
+
+	if(start_col > end_col) return;
+	attr = erase_attr(state);
+	unpair(state, row, start_col);
+	unpair(state, row, end_col + 1);
+	grid_clear_row(&state->buffer, row, start_col, end_col, attr);
+	set_dirty(state, row, start_col, end_col);
+	erase_outer(state, row, start_col, end_col, attr);
+}
+
+static void
+clear_line_to_start(PTYState *state)
+{
+	erase_cells(state, state->vrow, 0, state->vcol);
+	state->vcol = 0;
+}
+
+static void
+try_lockstep(PTYState *state)
+{
+	/* After a frame, the region shows what the child drew. At full
+	 * width, and with cursor, attributes and scroll region in step
+	 * too, the terminal does with the child's output what we do. */
+	state->lockstep = state->forward && state->full_width &&
+	    !state->scroll_pending && !state->wrap_pending &&
+	    state->parser.state == VT_GROUND && !state->parser.need &&
+	    state->scroll_top == 0 && state->scroll_bottom == state->h - 1 &&
+	    state->margin_top == 0 && state->margin_bottom == state->h - 1 &&
+	    state->real_row == state->y + state->vrow && state->real_col == state->x + state->vcol &&
+	    state->real_attr == current_attr(state);
+}
+
+static void
+sync_lockstep(PTYState *state)
+{
+	int row, arow, start;
+
+	/* What was forwarded is on the terminal, so the shown grid takes
+	 * every change since the last time. */
+	for(row = 0; row < state->h; ++row) {
+		arow = state->buffer.map[row];
+		if((start = state->buffer.dirtystart[arow]) == -1) continue;
+		memcpy(grid_row(&state->shown, row) + start, grid_row(&state->buffer, row) + start,
+		       (state->buffer.dirtyend[arow] - start + 1) * sizeof(Cell));
+		state->buffer.dirtystart[arow] = state->buffer.dirtyend[arow] = -1;
+	}
+	state->real_row = state->y + state->vrow;
+	state->real_col = state->wrap_pending ? -1 : state->x + state->vcol;
+}
+
+static void
+leave_lockstep(PTYState *state)
+{
+	/* From here on the renderer takes over until the next frame. */
+	sync_lockstep(state);
+	state->lockstep = 0;
+}
+
+static int
+forward_safe(PTYState *state, int action, char ch)
+{
+	const Parser *p = &state->parser;
+	int i;
+
+	/* Whether the terminal would do to the region what we do, given
+	 * how forward_op() sends it. Sequences we drop are safe too. */
+	switch(action) {
+	case VA_EXECUTE:
+		return ch != '\025' && !(ch == '\t' && state->wrap_pending);
+	case VA_ESC_DISPATCH:
+		return p->ninter || ch == 'D' || ch == 'E' || ch == 'M' || ch == '=' || ch == '>';
+	case VA_CSI_DISPATCH:
+		if(p->marker == '?' && !p->ninter && (ch == 'h' || ch == 'l')) {
+			for(i = 0; i < p->nparams; ++i) {
+				if(p->params[i] == 47 || p->params[i] == 1047 ||
+				   p->params[i] == 1048 || p->params[i] == 1049 ||
+				   p->params[i] == 7) return 0;
+			}
+			return 1;
+		}
+		if(p->marker || p->ninter) {
+			return p->marker || !(p->ninter == 1 && p->inter[0] == ' ' && ch == 'q');
+		}
+		/* Erases and shifts end a pending wrap on some terminals. */
+		if(state->wrap_pending && strchr("KLMST@PX", ch)) return 0;
+		return strchr("ABCDEFGHadef`KLMST@PXm", ch) != NULL;
+	}
+	return 1;
+}
+
+static void
+forward_op(PTYState *state, int action, char ch)
+{
+	const Parser *p = &state->parser;
+	int n;
+
+	/* Send what the child did, translated to the region. */
+	switch(action) {
+	case VA_EXECUTE:
+		if(ch == '\r' || ch == '\b') {
+			out_putc(&state->out, ch);
+		} else if(ch == '\n' || ch == '\v' || ch == '\f') {
+			out_putc(&state->out, '\n');
+		} else if(ch == '\t') {
+			/* Tab stops are the terminal's own. */
+			enc_csi(&state->out, state->x + state->vcol + 1, 'G');
+		}
+		break;
+	case VA_ESC_DISPATCH:
+		if(!p->ninter && (ch == 'D' || ch == 'E' || ch == 'M')) {
+			out_putc(&state->out, '\033');
+			out_putc(&state->out, ch);
+		}
+		break;
+	case VA_CSI_DISPATCH:
+		/* The rest have been sent or dropped by csi_dispatch(). */
+		if(p->marker || p->ninter) break;
+		n = (p->nparams > 0 && p->params[0] > 0) ? p->params[0] : 1;
+		switch(ch) {
+		case 'K':
+			n = (p->nparams > 0) ? p->params[0] : 0;
+			if(n <= 2) {
+				out_str(&state->out, ANSIESC);
+				enc_params(&state->out, &n, n != 0, 0);
+				out_putc(&state->out, 'K');
+			}
+			break;
+		case 'm':
+			apply_attributes(state, current_attr(state));
+			break;
+		case 'L': /* FALLTHROUGH */
+		case 'M':
+			/* Some terminals go to the left margin as well. */
+			enc_csi(&state->out, n, ch);
+			enc_csi2(&state->out, state->y + state->vrow + 1, state->x + state->vcol + 1, 'H');
+			break;
+		case 'S': /* FALLTHROUGH */
+		case 'T': /* FALLTHROUGH */
+		case '@': /* FALLTHROUGH */
+		case 'P': /* FALLTHROUGH */
+		case 'X':
+			enc_csi(&state->out, n, ch);
+			break;
+		default:
+			/* Cursor motion goes out as where it ended up. */
+			enc_csi2(&state->out, state->y + state->vrow + 1, state->x + state->vcol + 1, 'H');
+		}
+		break;
+	}
+}
+
+static size_t
+scan_printable(const char *s, size_t n)
+{
+	size_t i;
+#ifdef __SSE2__
+	__m128i v, bad, low, del;
+	int mask;
+
+	/* Bytes below 0x20 (ESC and the other controls) and bytes from 0x80
+	 * up are negative or small as signed chars, DEL is matched apart. */
+	low = _mm_set1_epi8(0x20);
+	del = _mm_set1_epi8(0x7f);
+	for(i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		bad = _mm_or_si128(_mm_cmplt_epi8(v, low), _mm_cmpeq_epi8(v, del));
+		mask = _mm_movemask_epi8(bad);
+		if(mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#else
+	i = 0;
+#endif
+	for(; i < n; ++i) {
+		if(s[i] < 0x20 || s[i] > 0x7e) break;
+	}
+	return i;
+}
+
+static void
+wrap_line(PTYState *state)
+{
+	if(state->vrow < state->scroll_bottom) {
+		++state->vrow;
+	} else {
+		scroll_up_pty(state, state->scroll_top, 1);
+	}
+	state->vcol = 0;
+	state->wrap_pending = 0;
+}
+
+static void
+unpair(PTYState *state, int row, int col)
+{
+	Cell *cell;
+
+	/* Blank a double width character about to be split at col. */
+	if(col <= 0 || col >= state->w) return;
+	cell = grid_row(&state->buffer, row) + col;
+	if(!(cell->flags & CELL_SPACER)) return;
+	cell[-1].ch = cell[0].ch = ' ';
+	cell[-1].flags = cell[0].flags = 0;
+	set_dirty(state, row, col - 1, col);
+}
+
+static void
+print_run(PTYState *state, const char *s, size_t n)
+{
+	size_t k, i;
+	Cell *cell;
+	int attr;
+
+	while(n > 0) {
+		if(state->wrap_pending) {
+			wrap_line(state);
+		}
+		/* After a scroll, which may have renumbered the table. */
+		attr = current_attr(state);
+
+		/* As much of the run as fits on this row, in one go. */
+		k = state->w - state->vcol;
+		if(k > n) {
+			k = n;
+		}
+		unpair(state, state->vrow, state->vcol);
+		unpair(state, state->vrow, state->vcol + k);
+		cell = grid_row(&state->buffer, state->vrow) + state->vcol;
+		for(i = 0; i < k; ++i) {
+			cell[i].ch = s[i];
+			cell[i].attr = attr;
+			cell[i].flags = 0;
+		}
+		set_dirty(state, state->vrow, state->vcol, state->vcol + k - 1);
+		state->vcol += k;
+		if(state->vcol == state->w) {
+			state->vcol = state->w - 1;
+			state->wrap_pending = 1;
+		}
+		state->last_char = (unsigned char)s[k - 1];
+		s += k;
+		n -= k;
+	}
+}
+
+static void
+print_char(PTYState *state, uint32_t cp)
+{
+	Cell *cell;
+	int width, attr;
+
+	/* Combining marks and C1 controls are dropped. */
+	width = utf8_width(cp);
+	if(width <= 0 || width > state->w) return;
+	if(state->wrap_pending || state->vcol + width > state->w) {
+		wrap_line(state);
+	}
+
+	attr = current_attr(state);
+	unpair(state, state->vrow, state->vcol);
+	unpair(state, state->vrow, state->vcol + width);
+	cell = grid_row(&state->buffer, state->vrow) + state->vcol;
+	cell[0].ch = cp;
+	cell[0].attr = attr;
+	cell[0].flags = (width == 2) ? CELL_WIDE : 0;
+	if(width == 2) {
+		cell[1].ch = ' ';
+		cell[1].attr = attr;
+		cell[1].flags = CELL_SPACER;
+	}
+	set_dirty(state, state->vrow, state->vcol, state->vcol + width - 1);
+	state->last_char = cp;
+	state->vcol += width;
+	if(state->vcol == state->w) {
+		state->vcol = state->w - 1;
+		state->wrap_pending = 1;
+	}
+}
+
+static void
+utf8_byte(PTYState *state, unsigned char ch)
+{
+	Parser *p = &state->parser;
+
+	if(p->need) {
+		if((ch & 0xc0) == 0x80) {
+			p->cp = p->cp << 6 | (ch & 0x3f);
+			if(--p->need) return;
+			/* Overlong forms, surrogates and beyond are invalid. */
+			if(p->cp < p->min || (p->cp >= 0xd800 && p->cp <= 0xdfff) || p->cp > 0x10ffff) {
+				p->cp = UTF8_REPLACEMENT;
+			}
+			print_char(state, p->cp);
+			return;
+		}
+		/* Cut short, this byte starts afresh. */
+		p->need = 0;
+		print_char(state, UTF8_REPLACEMENT);
+	}
+	if(ch >= 0xc2 && ch <= 0xdf) {
+		p->cp = ch & 0x1f;
+		p->need = 1;
+		p->min = 0x80;
+	} else if(ch >= 0xe0 && ch <= 0xef) {
+		p->cp = ch & 0x0f;
+		p->need = 2;
+		p->min = 0x800;
+	} else if(ch >= 0xf0 && ch <= 0xf4) {
+		p->cp = ch & 0x07;
+		p->need = 3;
+		p->min = 0x10000;
+	} else {
+		print_char(state, UTF8_REPLACEMENT);
+	}
+}
+
+static void
+utf8_cut(PTYState *state)
+{
+	if(state->parser.need) {
+		state->parser.need = 0;
+		print_char(state, UTF8_REPLACEMENT);
+	}
+}
+
+static size_t
+print_text(PTYState *state, const char *s, size_t n)
+{
+	size_t i, k;
+	unsigned char ch;
+
+	/* ASCII goes through in runs, only the rest is decoded. A
+	 * sequence may continue in the next read. */
+	for(i = 0; i < n; ) {
+		ch = s[i];
+		if(ch < 0x80) {
+			if(ch < 0x20 || ch == 0x7f) break;
+			utf8_cut(state);
+			k = scan_printable(s + i, n - i);
+			print_run(state, s + i, k);
+			i += k;
+		} else {
+			utf8_byte(state, ch);
+			++i;
+		}
+	}
+	return i;
+}
+
+static void
+save_cursor(PTYState *state)
+{
+	state->saved_vrow = state->vrow;
+	state->saved_vcol = state->vcol;
+}
+
+static void
+restore_cursor(PTYState *state)
+{
+	state->vrow = state->saved_vrow;
+	state->vcol = state->saved_vcol;
+	if(state->vrow < state->scroll_top) {
+		state->vrow = state->scroll_top;
+	}
+	if(state->vrow > state->scroll_bottom) {
+		state->vrow = state->scroll_bottom;
+	}
+	state->wrap_pending = 0;
+}
+
+static void
+erase_screen(PTYState *state)
+{
+	int i;
+
+	for(i = 0; i < state->h; ++i) {
+		erase_cells(state, i, 0, state->w - 1);
+	}
+}
+
+static void
+switch_screen(PTYState *state, int alt)
+{
+	Grid t;
+
+	if(alt == state->altscreen) return;
+	t = state->buffer;
+	state->buffer = state->alt;
+	state->alt = t;
+	state->altscreen = alt;
+	state->wrap_pending = 0;
+	/* Whatever of the other screen is still shown is not sent again. */
+	set_dirty_rows(state, 0, state->h - 1);
+}
+
+static void
+handle_control(PTYState *state, char ch)
+{
+	state->last_char = 0;
+	switch(ch) {
+	case '\n': /* FALLTHROUGH */
+	case '\v': /* FALLTHROUGH */
+	case '\f':
 		if(state->vrow < state->scroll_bottom) {
 			++state->vrow;
 		} else {
-			scroll_up_pty(state, 1);
+			scroll_up_pty(state, state->scroll_top, 1);
 		}
 		state->wrap_pending = 0;
-		move_to_real(state->x, state->y, state->vrow, state->vcol);
 		break;
 	case '\r':
 		state->vcol = 0;
 		state->wrap_pending = 0;
-		move_to_real(state->x, state->y, state->vrow, state->vcol);
 		break;
 	case '\b':
 		if(state->vcol > 0) {
 			--state->vcol;
-			state->wrap_pending = 0;
-			move_to_real(state->x, state->y, state->vrow, state->vcol);
-			apply_attributes(state->current_attr);
-			putchar(' ');
-			state->buffer[state->vrow][state->vcol].ch = ' ';
-			state->buffer[state->vrow][state->vcol].attr = state->current_attr;
-			move_to_real(state->x, state->y, state->vrow, state->vcol);
-			fflush(stdout);
+		}
+		state->wrap_pending = 0;
+		break;
+	case '\t':
+		state->vcol = (state->vcol / 8 + 1) * 8;
+		if(state->vcol > state->w - 1) {
+			state->vcol = state->w - 1;
 		}
 		break;
 	case '\025': /* C-U */
 		clear_line_to_start(state);
 		state->wrap_pending = 0;
 		break;
-	default:
-		if(isprint(ch)) {
-			if(state->wrap_pending) {
-				if(state->vrow < state->scroll_bottom) {
-					++state->vrow;
-				} else {
-					scroll_up_pty(state, 1);
-				}
-				state->vcol = 0;
-				state->wrap_pending = 0;
-			}
-			move_to_real(state->x, state->y, state->vrow, state->vcol);
-			if(state->vcol == state->w - 1) {
-				printf(ANSIESC "?7l");
-			}
-			apply_attributes(state->current_attr);
-			putchar(ch);
-			state->buffer[state->vrow][state->vcol].ch = ch;
-			state->buffer[state->vrow][state->vcol].attr = state->current_attr;
-			if(state->vcol == state->w - 1) {
-				printf(ANSIESC "?7h");
-				state->wrap_pending = 1;
-			} else {
-				++state->vcol;
-			}
-			fflush(stdout);
+	}
+}
+
+static int
+sgr_rgb(const int *rgb)
+{
+	int i, color;
+
+	color = COLOR_RGB;
+	for(i = 0; i < 3; ++i) {
+		color |= ((rgb[i] > 255) ? 255 : rgb[i]) << (16 - 8 * i);
+	}
+	return color;
+}
+
+static int
+sgr_color(const Parser *p, int n, int *color)
+{
+	const int *params = p->params;
+	int last;
+
+	/* 38:5:i, and 38:2:r:g:b with or without a colour space before r.
+	 * The caller skips the sub-parameters. */
+	if(n + 1 < p->nparams && (p->sub >> (n + 1) & 1)) {
+		for(last = n + 1; last + 1 < p->nparams && (p->sub >> (last + 1) & 1); ++last);
+		if(params[n+1] == 5 && last >= n + 2 && params[n+2] < 256) {
+			*color = params[n+2];
+		} else if(params[n+1] == 2 && last >= n + 4) {
+			*color = sgr_rgb(params + last - 2);
+		}
+		return n;
+	}
+	if(n + 2 < p->nparams && params[n+1] == 5) {
+		if(params[n+2] < 256) {
+			*color = params[n+2];
+		}
+		return n + 2;
+	}
+	if(n + 1 < p->nparams && params[n+1] == 2) {
+		if(n + 4 < p->nparams) {
+			*color = sgr_rgb(params + n + 2);
+			return n + 4;
 		}
+		return p->nparams - 1;
 	}
+	return n;
 }
 
 static int
-handle_csi_sequence(PTYState *state, int *params, int param_count, char final_char)
+handle_csi_sequence(PTYState *state, const Parser *p, char final_char)
 {
-	int n, m, handled;
-	int svrow, svcol, swrap;
+	const int *params = p->params;
+	int param_count = p->nparams;
+	int n, m, handled, attr;
+	Cell *line;
 
 #define IF_UNDEF_1(P) (param_count > P && params[P] > 0) ? params[P] : 1;
 	n = IF_UNDEF_1(0);
@@ -434,29 +2297,34 @@ handle_csi_sequence(PTYState *state, int *params, int param_count, char final_ch
 	handled = 1;
 	
 	switch(final_char) {
+	case 'F': /* cursor to start of line up */
+		state->vcol = 0;
+		/* FALLTHROUGH */
 	case 'A': /* cursor up */
 		state->vrow -= n;
 		if(state->vrow < state->scroll_top) {
 			state->vrow = state->scroll_top;
 		}
 		state->wrap_pending = 0;
-		move_to_real(state->x, state->y, state->vrow, state->vcol);
 		break;
+	case 'E': /* cursor to start of line down */
+		state->vcol = 0;
+		/* FALLTHROUGH */
+	case 'e': /* FALLTHROUGH */
 	case 'B': /* cursor down */
 		state->vrow += n;
 		if(state->vrow > state->scroll_bottom) {
 			state->vrow = state->scroll_bottom;
 		}
 		state->wrap_pending = 0;
-		move_to_real(state->x, state->y, state->vrow, state->vcol);
 		break;
+	case 'a': /* FALLTHROUGH */
 	case 'C': /* cursor right */
 		state->vcol += n;
 		if(state->vcol > state->w - 1) {
 			state->vcol = state->w - 1;
 		}
 		state->wrap_pending = 0;
-		move_to_real(state->x, state->y, state->vrow, state->vcol);
 		break;
 	case 'D': /* cursor left */
 		state->vcol -= n;
@@ -464,7 +2332,6 @@ handle_csi_sequence(PTYState *state, int *params, int param_count, char final_ch
 			state->vcol = 0;
 		}
 		state->wrap_pending = 0;
-		move_to_real(state->x, state->y, state->vrow, state->vcol);
 		break;
 	case 'H': /* FALLTHROUGH */
 	case 'f': /* jump cursor */
@@ -482,94 +2349,40 @@ handle_csi_sequence(PTYState *state, int *params, int param_count, char final_ch
 			state->vcol = state->w - 1;
 		}
 		state->wrap_pending = 0;
-		move_to_real(state->x, state->y, state->vrow, state->vcol);
 		break;
 	case 'J': /* erase */
-		svrow = state->vrow;
-		svcol = state->vcol;
-		swrap = state->wrap_pending;
 		switch((param_count > 0) ? params[0] : 0) {
 		case 0: /* till end of screen */
-			for(n = state->vcol; n < state->w; ++n) {
-				reset_cell(state->buffer[state->vrow] + n);
-			}
-			redraw_line(state, state->vrow, state->vcol, state->w - 1);
+			erase_cells(state, state->vrow, state->vcol, state->w - 1);
 			for(n = state->vrow + 1; n < state->h; ++n) {
-				for(m = 0; m < state->w; ++m) {
-					reset_cell(state->buffer[n] + m);
-				}
-				redraw_line(state, n, 0, state->w - 1);
+				erase_cells(state, n, 0, state->w - 1);
 			}
 			break;
 		case 1: /* till beginning of screen */
 			for(n = 0; n < state->vrow; ++n) {
-				for(m = 0; m < state->w; ++m) {
-					reset_cell(state->buffer[n] + m);
-				}
-				redraw_line(state, n, 0, state->w - 1);
-			}
-			for(n = 0; n <= state->vcol; ++n) {
-				reset_cell(state->buffer[state->vrow] + n);
+				erase_cells(state, n, 0, state->w - 1);
 			}
-			redraw_line(state, state->vrow, 0, state->vcol);
+			erase_cells(state, state->vrow, 0, state->vcol);
 			break;
-		case 2: /* FALLTHROUGH, not supported */
-		case 3: /* entire screen */
-			for(n = 0; n < state->h; ++n) {
-				for(m = 0; m < state->w; ++m) {
-					reset_cell(state->buffer[n] + m);
-				}
-				redraw_line(state, n, 0, state->w - 1);
-			}
-			state->current_attr.fg = state->current_attr.bg = -1;
-			state->current_attr.attr = 0;
+		case 2: /* entire screen */
+			erase_screen(state);
+			break;
+		case 3: /* scrollback, of which there is none */
 			break;
 		}
-		state->vrow = svrow;
-		state->vcol = svcol;
-		state->wrap_pending = swrap;
-        move_to_real(state->x, state->y, state->vrow, state->vcol);
 		break;
 	case 'K': /* erase line */
-		svcol = state->vcol;
-		swrap = state->wrap_pending;
 		switch((param_count > 0) ? params[0] : 0) {
 		case 0: /* till end of line */
-			for(n = state->vcol; n < state->w; ++n) {
-				reset_cell(state->buffer[state->vrow] + n);
-			}
-			move_to_real(state->x, state->y, state->vrow, state->vcol);
-			apply_attributes(state->current_attr);
-			for(n = state->vcol; n < state->w; ++n) {
-				putchar(' ');
-			}
-			move_to_real(state->x, state->y, state->vrow, svcol);
+			erase_cells(state, state->vrow, state->vcol, state->w - 1);
 			break;
 		case 1: /* till start of line */
-			for(n = 0; n < state->vcol; ++n) {
-				reset_cell(state->buffer[state->vrow] + n);
-			}
-			move_to_real(state->x, state->y, state->vrow, 0);
-			apply_attributes(state->current_attr);
-			for(n = 0; n < state->vcol; ++n) {
-				putchar(' ');
-			}
-			move_to_real(state->x, state->y, state->vrow, svcol);
+			erase_cells(state, state->vrow, 0, state->vcol);
 			break;
 		case 2: /* entire line */
-			for(n = 0; n < state->w; ++n) {
-				reset_cell(state->buffer[state->vrow] + n);
-			}
-			move_to_real(state->x, state->y, state->vrow, 0);
-			apply_attributes(state->current_attr);
-			for(n = 0; n < state->w; ++n) {
-				putchar(' ');
-			}
-			move_to_real(state->x, state->y, state->vrow, svcol);
+			erase_cells(state, state->vrow, 0, state->w - 1);
 			break;
 		}
-		state->wrap_pending = swrap;
-		fflush(stdout);
 		break;
 	case 'r': /* scrolling region */
 		--n;
@@ -579,73 +2392,92 @@ handle_csi_sequence(PTYState *state, int *params, int param_count, char final_ch
 			state->scroll_bottom = m;
 			state->vrow = state->scroll_top;
 			state->vcol = 0;
-			move_to_real(state->x, state->y, state->vrow, state->vcol);
 		}
 		break;
 	case 's': /* save cursor */
-		state->saved_vrow = state->vrow;
-		state->saved_vcol = state->vcol;
+		save_cursor(state);
 		break;
 	case 'u': /* restore cursor */
-		state->vrow = state->saved_vrow;
-		state->vcol = state->saved_vcol;
-		if(state->vrow  < state->scroll_top) {
-			state->vrow = state->scroll_top;
-		}
-		if(state->vrow > state->scroll_bottom) {
-			state->scroll_bottom = state->scroll_bottom;
+		restore_cursor(state);
+		break;
+	case 'd': /* cursor absolute row */
+		state->vrow = n - 1;
+		if(state->vrow >= state->h) {
+			state->vrow = state->h - 1;
 		}
 		state->wrap_pending = 0;
-		move_to_real(state->x, state->y, state->vrow, state->vcol);
 		break;
+	case '`': /* FALLTHROUGH */
 	case 'G': /* cursor absolute column */
 		state->vcol = n - 1;
 		if(state->vcol >= state->w) {
 			state->vcol = state->w - 1;
 		}
 		state->wrap_pending = 0;
-		move_to_real(state->x, state->y, state->vrow, state->vcol);
 		break;
 	case 'L': /* insert line */
 		if(state->vrow >= state->scroll_top && state->vrow <= state->scroll_bottom) {
-			scroll_down_pty(state, n);
+			scroll_down_pty(state, state->vrow, n);
 		}
 		break;
 	case 'M': /* delete line */
 		if(state->vrow >= state->scroll_top && state->vrow <= state->scroll_bottom) {
-			scroll_up_pty(state, n);
+			scroll_up_pty(state, state->vrow, n);
 		}
 		break;
+	case 'S': /* scroll up */
+		scroll_up_pty(state, state->scroll_top, n);
+		break;
+	case 'T': /* scroll down */
+		scroll_down_pty(state, state->scroll_top, n);
+		break;
 	case '@': /* insert char */
 		if(state->vcol + n > state->w) {
 			n = state->w - state->vcol;
 		}
-		memmove(state->buffer[state->vrow] + state->vcol + n, state->buffer[state->vrow] + state->vcol, (state->w - state->vcol - n) * sizeof(Cell));
-		for(m = 0; m < n; ++m) {
-			reset_cell(state->buffer[state->vrow] + state->vcol + m);
-		}
-		redraw_line(state, state->vrow, state->vcol, state->w - 1);
+		unpair(state, state->vrow, state->vcol);
+		unpair(state, state->vrow, state->w - n);
+		attr = erase_attr(state);
+		line = grid_row(&state->buffer, state->vrow);
+		memmove(line + state->vcol + n, line + state->vcol, (state->w - state->vcol - n) * sizeof(Cell));
+		grid_clear_row(&state->buffer, state->vrow, state->vcol, state->vcol + n - 1, attr);
+		shift_outer(state, state->vrow, state->vcol, n, attr, '@');
+		set_dirty(state, state->vrow, state->vcol, state->w - 1);
 		break;
 	case 'P': /* delete char */
 		if(state->vcol + n > state->w) {
 			n = state->w - state->vcol;
 		}
-		memmove(state->buffer[state->vrow] + state->vcol, state->buffer[state->vrow] + state->vcol + n, (state->w - state->vcol - n) * sizeof(Cell));
-		for(m = state->w - n; m < state->w; ++m) {
-			reset_cell(state->buffer[state->vrow] + m);
-		}
-		redraw_line(state, state->vrow, state->vcol, state->w - 1);
+		unpair(state, state->vrow, state->vcol);
+		unpair(state, state->vrow, state->vcol + n);
+		attr = erase_attr(state);
+		line = grid_row(&state->buffer, state->vrow);
+		memmove(line + state->vcol, line + state->vcol + n, (state->w - state->vcol - n) * sizeof(Cell));
+		grid_clear_row(&state->buffer, state->vrow, state->w - n, state->w - 1, attr);
+		shift_outer(state, state->vrow, state->vcol, n, attr, 'P');
+		set_dirty(state, state->vrow, state->vcol, state->w - 1);
 		break;
 	case 'X': /* erase char */
 		if(state->vcol + n > state->w) {
 			n = state->w - state->vcol;
 		}
-		for(m = 0; m < n; ++m) {
-			reset_cell(state->buffer[state->vrow] + state->vcol + m);
+		erase_cells(state, state->vrow, state->vcol, state->vcol + n - 1);
+		break;
+	case 'b': /* repeat last char */
+		/* Past a screenful, whole lines more only scroll the same
+		 * character through, so skip those. */
+		m = state->w * state->h;
+		if(n > m) {
+			n -= (n - m) / state->w * state->w;
+		}
+		while(state->last_char && n-- > 0) {
+			print_char(state, state->last_char);
 		}
-		redraw_line(state, state->vrow, state->vcol, state->vcol + n - 1);
 		break;
 	case 'm': /* graphics */
+		if(param_count == 0) {
+			state->current_attr = plain_attr;
+		}
 		n = 0;
 		while(n < param_count) {
 			m = params[n];
@@ -663,8 +2495,12 @@ handle_csi_sequence(PTYState *state, int *params, int param_count, char final_ch
 			case 3:
 				state->current_attr.attr |= ATTR_ITALIC;
 				break;
-			case 4:
-				state->current_attr.attr |= ATTR_UNDERLINE;
+			case 4: /* 4:0 is off, 4:1 and up are underline styles */
+				if(n + 1 < param_count && (p->sub >> (n + 1) & 1) && params[n+1] == 0) {
+					state->current_attr.attr &= ~ATTR_UNDERLINE;
+				} else {
+					state->current_attr.attr |= ATTR_UNDERLINE;
+				}
 				break;
 			case 5:
 				state->current_attr.attr |= ATTR_BLINK;
@@ -710,10 +2546,7 @@ handle_csi_sequence(PTYState *state, int *params, int param_count, char final_ch
 				state->current_attr.fg = m - 30;
 				break;
 			case 38:
-				if(n + 2 < param_count && params[n+1] == 5) {
-					state->current_attr.fg = params[n+2];
-					n += 2;
-				}
+				n = sgr_color(p, n, &state->current_attr.fg);
 				break;
 			case 39:
 				state->current_attr.fg = -1;
@@ -729,10 +2562,7 @@ handle_csi_sequence(PTYState *state, int *params, int param_count, char final_ch
 				state->current_attr.bg = m - 40;
 				break;
 			case 48:
-				if(n + 2 < param_count && params[n+1] == 5) {
-					state->current_attr.bg = params[n+2];
-					n += 2;
-				}
+				n = sgr_color(p, n, &state->current_attr.bg);
 				break;
 			case 49:
 				state->current_attr.bg = -1;
@@ -758,8 +2588,13 @@ handle_csi_sequence(PTYState *state, int *params, int param_count, char final_ch
 				state->current_attr.bg = m - 92;
 				break;
 			}
+			/* Sub-parameters belong to the one before. */
+			while(n + 1 < param_count && (p->sub >> (n + 1) & 1)) {
+				++n;
+			}
 			++n;
 		}
+		state->current_index = -1;
 		break;
 	default:
 		handled = 0;
@@ -768,195 +2603,609 @@ handle_csi_sequence(PTYState *state, int *params, int param_count, char final_ch
 	return handled;
 }
 
+static void
+set_private_modes(PTYState *state, char final_char)
+{
+	const Parser *p = &state->parser;
+	int keep[MAX_PARAMS];
+	int i, n, set;
+
+	set = (final_char == 'h');
+	for(i = n = 0; i < p->nparams; ++i) {
+		switch(p->params[i]) {
+		case 47: /* alternate screen */
+			switch_screen(state, set);
+			break;
+		case 1047: /* alternate screen, cleared on leaving */
+			if(!set && state->altscreen) {
+				erase_screen(state);
+			}
+			switch_screen(state, set);
+			break;
+		case 1048: /* save cursor */
+			if(set) {
+				save_cursor(state);
+			} else {
+				restore_cursor(state);
+			}
+			break;
+		case 1049: /* both, with the alternate screen cleared */
+			if(set && !state->altscreen) {
+				save_cursor(state);
+				switch_screen(state, 1);
+				erase_screen(state);
+			} else if(!set && state->altscreen) {
+				switch_screen(state, 0);
+				restore_cursor(state);
+			}
+			break;
+		case 3:    /* column mode, clears and resets margins */
+		case 6:    /* origin mode, we send absolute positions */
+		case 69:   /* left and right margins are ours */
+		case 1000: case 1001: case 1002: case 1003:
+		case 1004: case 1005: case 1006: case 1015:
+		case 1016: case 2004:
+			break;
+		default:
+			keep[n++] = p->params[i];
+		}
+	}
+	if(n == 0) return;
+	flush_scroll(state);
+	out_str(&state->out, ANSIESC "?");
+	enc_params(&state->out, keep, n, 0);
+	out_putc(&state->out, final_char);
+}
+
+static void
+passthrough_csi(PTYState *state, char final_char)
+{
+	const Parser *p = &state->parser;
+
+	flush_scroll(state);
+	out_str(&state->out, ANSIESC);
+	if(p->marker) {
+		out_putc(&state->out, p->marker);
+	}
+	enc_params(&state->out, p->params, p->nparams, p->sub);
+	out_write(&state->out, p->inter, p->ninter);
+	out_putc(&state->out, final_char);
+	if(!p->marker) {
+		state->real_attr = -1;
+		state->real_row = state->real_col = -1;
+	}
+}
+
+static void
+esc_dispatch(PTYState *state, char final_char)
+{
+	state->last_char = 0;
+	/* Character set designations, DECALN and the like. */
+	if(state->parser.ninter) return;
+
+	switch(final_char) {
+	case '7': /* save cursor */
+		save_cursor(state);
+		break;
+	case '8': /* restore cursor */
+		restore_cursor(state);
+		break;
+	case 'E': /* next line */
+		state->vcol = 0;
+		/* FALLTHROUGH */
+	case 'D': /* index */
+		if(state->vrow < state->scroll_bottom) {
+			++state->vrow;
+		} else {
+			scroll_up_pty(state, state->scroll_top, 1);
+		}
+		state->wrap_pending = 0;
+		break;
+	case 'M': /* reverse index */
+		if(state->vrow > state->scroll_top) {
+			--state->vrow;
+		} else {
+			scroll_down_pty(state, state->scroll_top, 1);
+		}
+		state->wrap_pending = 0;
+		break;
+	case 'c': /* full reset, of the region only */
+		switch_screen(state, 0);
+		state->current_attr = plain_attr;
+		state->current_index = -1;
+		state->scroll_top = 0;
+		state->scroll_bottom = state->h - 1;
+		erase_screen(state);
+		state->vrow = state->vcol = state->saved_vrow = state->saved_vcol = 0;
+		state->wrap_pending = 0;
+		break;
+	case '=': /* FALLTHROUGH */
+	case '>': /* keypad modes, the child reads the keys */
+		flush_scroll(state);
+		out_putc(&state->out, '\033');
+		out_putc(&state->out, final_char);
+		break;
+	}
+}
+
+static void
+csi_dispatch(PTYState *state, char final_char)
+{
+	const Parser *p = &state->parser;
+
+	/* REP repeats a character printed right before it, and only that. */
+	if(final_char != 'b' || p->marker || p->ninter) {
+		state->last_char = 0;
+	}
+	if(p->marker == 0 && p->ninter == 0) {
+		if(handle_csi_sequence(state, p, final_char)) return;
+	} else if(p->marker == '?' && p->ninter == 0 && (final_char == 'h' || final_char == 'l')) {
+		set_private_modes(state, final_char);
+		return;
+	} else if(p->ninter && !(p->ninter == 1 && p->inter[0] == ' ' && final_char == 'q')) {
+		/* Soft reset, mode requests and the like would act on the
+		 * whole outer terminal. Only the cursor style goes through. */
+		return;
+	}
+	passthrough_csi(state, final_char);
+}
+
+static void
+vt_rule(int st, int lo, int hi, int action, int next)
+{
+	int c, flags;
+
+	if(next == -1) {
+		next = st;
+		flags = 0;
+	} else {
+		flags = (next == VT_ESCAPE || next == VT_CSI_ENTRY || next == VT_DCS_ENTRY) ? VT_CLEAR : 0;
+	}
+	for(c = lo; c <= hi; ++c) {
+		vt_table[st][c] = action | next << 4 | flags;
+	}
+}
+
+static void
+vt_init(void)
+{
+	int s;
+
+	for(s = 0; s < VT_STATES; ++s) {
+		vt_rule(s, 0x00, 0xff, VA_NONE, -1);
+		/* Controls still act inside sequences, strings drop them. */
+		if(s <= VT_CSI_IGNORE) {
+			vt_rule(s, 0x00, 0x17, VA_EXECUTE, -1);
+			vt_rule(s, 0x19, 0x19, VA_EXECUTE, -1);
+			vt_rule(s, 0x1c, 0x1f, VA_EXECUTE, -1);
+		}
+		/* Anywhere. The 8-bit C1 forms are left out, those bytes
+		 * are UTF-8. */
+		vt_rule(s, 0x18, 0x18, VA_EXECUTE, VT_GROUND);
+		vt_rule(s, 0x1a, 0x1a, VA_EXECUTE, VT_GROUND);
+		vt_rule(s, 0x1b, 0x1b, VA_NONE, VT_ESCAPE);
+	}
+
+	vt_rule(VT_GROUND, 0x20, 0xff, VA_PRINT, -1);
+
+	vt_rule(VT_ESCAPE, 0x20, 0x2f, VA_COLLECT, VT_ESCAPE_INTERMEDIATE);
+	vt_rule(VT_ESCAPE, 0x30, 0x7e, VA_ESC_DISPATCH, VT_GROUND);
+	vt_rule(VT_ESCAPE, 'P', 'P', VA_NONE, VT_DCS_ENTRY);
+	vt_rule(VT_ESCAPE, 'X', 'X', VA_NONE, VT_SOS_PM_APC_STRING);
+	vt_rule(VT_ESCAPE, '^', '_', VA_NONE, VT_SOS_PM_APC_STRING);
+	vt_rule(VT_ESCAPE, '[', '[', VA_NONE, VT_CSI_ENTRY);
+	vt_rule(VT_ESCAPE, ']', ']', VA_NONE, VT_OSC_STRING);
+
+	vt_rule(VT_ESCAPE_INTERMEDIATE, 0x20, 0x2f, VA_COLLECT, -1);
+	vt_rule(VT_ESCAPE_INTERMEDIATE, 0x30, 0x7e, VA_ESC_DISPATCH, VT_GROUND);
+
+	/* Unlike the original, ':' separates sub-parameters. */
+	vt_rule(VT_CSI_ENTRY, 0x20, 0x2f, VA_COLLECT, VT_CSI_INTERMEDIATE);
+	vt_rule(VT_CSI_ENTRY, 0x30, 0x3b, VA_PARAM, VT_CSI_PARAM);
+	vt_rule(VT_CSI_ENTRY, 0x3c, 0x3f, VA_COLLECT, VT_CSI_PARAM);
+	vt_rule(VT_CSI_ENTRY, 0x40, 0x7e, VA_CSI_DISPATCH, VT_GROUND);
+
+	vt_rule(VT_CSI_PARAM, 0x20, 0x2f, VA_COLLECT, VT_CSI_INTERMEDIATE);
+	vt_rule(VT_CSI_PARAM, 0x30, 0x3b, VA_PARAM, -1);
+	vt_rule(VT_CSI_PARAM, 0x3c, 0x3f, VA_NONE, VT_CSI_IGNORE);
+	vt_rule(VT_CSI_PARAM, 0x40, 0x7e, VA_CSI_DISPATCH, VT_GROUND);
+
+	vt_rule(VT_CSI_INTERMEDIATE, 0x20, 0x2f, VA_COLLECT, -1);
+	vt_rule(VT_CSI_INTERMEDIATE, 0x30, 0x3f, VA_NONE, VT_CSI_IGNORE);
+	vt_rule(VT_CSI_INTERMEDIATE, 0x40, 0x7e, VA_CSI_DISPATCH, VT_GROUND);
+
+	vt_rule(VT_CSI_IGNORE, 0x40, 0x7e, VA_NONE, VT_GROUND);
+
+	/* A DCS is dropped, only its end has to be found. */
+	vt_rule(VT_DCS_ENTRY, 0x20, 0x2f, VA_NONE, VT_DCS_INTERMEDIATE);
+	vt_rule(VT_DCS_ENTRY, 0x30, 0x3f, VA_NONE, VT_DCS_PARAM);
+	vt_rule(VT_DCS_ENTRY, 0x40, 0x7e, VA_NONE, VT_DCS_PASSTHROUGH);
+
+	vt_rule(VT_DCS_PARAM, 0x20, 0x2f, VA_NONE, VT_DCS_INTERMEDIATE);
+	vt_rule(VT_DCS_PARAM, 0x3c, 0x3f, VA_NONE, VT_DCS_IGNORE);
+	vt_rule(VT_DCS_PARAM, 0x40, 0x7e, VA_NONE, VT_DCS_PASSTHROUGH);
+
+	vt_rule(VT_DCS_INTERMEDIATE, 0x30, 0x3f, VA_NONE, VT_DCS_IGNORE);
+	vt_rule(VT_DCS_INTERMEDIATE, 0x40, 0x7e, VA_NONE, VT_DCS_PASSTHROUGH);
+
+	/* BEL ends an OSC too, as in xterm. */
+	vt_rule(VT_OSC_STRING, 0x07, 0x07, VA_NONE, VT_GROUND);
+}
+
+static void
+vt_clear(Parser *p)
+{
+	p->nparams = 0;
+	p->sub = 0;
+	p->cur = 0;
+	p->started = 0;
+	p->marker = 0;
+	p->ninter = 0;
+	p->overflow = 0;
+}
+
+static void
+vt_param(Parser *p, char ch)
+{
+	p->started = 1;
+	if(ch <= '9') {
+		if(p->cur < 100000) {
+			p->cur = p->cur * 10 + ch - '0';
+		}
+		return;
+	}
+	if(p->nparams < MAX_PARAMS) {
+		p->params[p->nparams++] = p->cur;
+		if(ch == ':' && p->nparams < MAX_PARAMS) {
+			p->sub |= 1u << p->nparams;
+		}
+	}
+	p->cur = 0;
+}
+
+static size_t
+scan_string(const char *s, size_t n)
+{
+	size_t i;
+#ifdef __SSE2__
+	__m128i v, hit;
+	int mask;
+
+	/* BEL, CAN, SUB and ESC are all that can end a string. */
+	for(i = 0; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(s + i));
+		hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(0x07)),
+		                                _mm_cmpeq_epi8(v, _mm_set1_epi8(0x18))),
+		                   _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(0x1a)),
+		                                _mm_cmpeq_epi8(v, _mm_set1_epi8(0x1b))));
+		mask = _mm_movemask_epi8(hit);
+		if(mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+#else
+	i = 0;
+#endif
+	for(; i < n; ++i) {
+		if(s[i] == 0x07 || s[i] == 0x18 || s[i] == 0x1a || s[i] == 0x1b) break;
+	}
+	return i;
+}
+
+static void
+vt_feed(PTYState *state, const char *buf, size_t n)
+{
+	Parser *p = &state->parser;
+	unsigned char ch;
+	unsigned int e;
+	size_t i, k;
+
+	for(i = 0; i < n; ++i) {
+		ch = buf[i];
+		if(p->state == VT_GROUND && ch >= 0x20 && ch != 0x7f) {
+			if(state->lockstep) {
+				/* ASCII is forwarded as it is, the rest rendered.
+				 * Past a screenful in one frame a repaint is
+				 * cheaper, so a flood goes to the renderer. */
+				k = scan_printable(buf + i, n - i);
+				if(k && state->forwarded + k <= (size_t)state->w * state->h) {
+					print_run(state, buf + i, k);
+					out_write(&state->out, buf + i, k);
+					state->forwarded += k;
+					i += k - 1;
+					continue;
+				}
+				leave_lockstep(state);
+			}
+			i += print_text(state, buf + i, n - i) - 1;
+			continue;
+		}
+		utf8_cut(state);
+		if(p->state >= VT_DCS_PASSTHROUGH) {
+			/* Strings are dropped whole, skip to what may end them. */
+			i += scan_string(buf + i, n - i);
+			if(i == n) break;
+			ch = buf[i];
+		}
+
+		e = vt_table[p->state][ch];
+		if(e & VT_CLEAR) {
+			vt_clear(p);
+		}
+		p->state = e >> 4 & 0xf;
+		switch(e & 0xf) {
+		case VA_PRINT:
+			/* DEL, the rest went to print_text(). */
+			break;
+		case VA_EXECUTE:
+			if(state->lockstep && !forward_safe(state, VA_EXECUTE, ch)) {
+				leave_lockstep(state);
+			}
+			handle_control(state, ch);
+			if(state->lockstep) {
+				forward_op(state, VA_EXECUTE, ch);
+			}
+			break;
+		case VA_COLLECT:
+			if(ch >= 0x3c) {
+				p->marker = ch;
+			} else if(p->ninter < MAX_INTERMEDIATES) {
+				p->inter[p->ninter++] = ch;
+			} else {
+				p->overflow = 1;
+			}
+			break;
+		case VA_PARAM:
+			vt_param(p, ch);
+			break;
+		case VA_ESC_DISPATCH:
+			if(p->overflow) break;
+			if(state->lockstep && !forward_safe(state, VA_ESC_DISPATCH, ch)) {
+				leave_lockstep(state);
+			}
+			esc_dispatch(state, ch);
+			if(state->lockstep) {
+				forward_op(state, VA_ESC_DISPATCH, ch);
+			}
+			break;
+		case VA_CSI_DISPATCH:
+			if(p->started) {
+				vt_param(p, ';');
+			}
+			if(p->overflow) break;
+			if(state->lockstep && !forward_safe(state, VA_CSI_DISPATCH, ch)) {
+				leave_lockstep(state);
+			}
+			csi_dispatch(state, ch);
+			if(state->lockstep) {
+				forward_op(state, VA_CSI_DISPATCH, ch);
+			}
+			break;
+		}
+	}
+}
+
+static int
+queue_read(int fd, Queue *q)
+{
+	ssize_t r;
+
+	if(q->start + q->len == sizeof(q->data)) {
+		memmove(q->data, q->data + q->start, q->len);
+		q->start = 0;
+	}
+	do {
+		r = read(fd, q->data + q->start + q->len, sizeof(q->data) - q->start - q->len);
+	} while(r < 0 && errno == EINTR);
+	if(r > 0) {
+		q->len += r;
+	}
+	return (r < 0 && errno == EAGAIN) ? 1 : r;
+}
+
+static int
+queue_write(int fd, Queue *q)
+{
+	ssize_t r;
+
+	while(q->len > 0) {
+		r = write(fd, q->data + q->start, q->len);
+		if(r < 0) {
+			if(errno == EINTR) continue;
+			return (errno == EAGAIN) ? 0 : -1;
+		}
+		q->start += r;
+		q->len -= r;
+	}
+	q->start = 0;
+	return 0;
+}
+
+static int
+read_child(int master, PTYState *state, char *buff)
+{
+	ssize_t r;
+	size_t budget;
+
+	/* Parse up to a budget, so that a flood still gets frames. */
+	for(budget = 0; budget < READ_BUDGET; budget += r) {
+		r = read(master, buff, BUFFER_SIZE);
+		if(r < 0 && errno == EINTR) {
+			r = 0;
+			continue;
+		}
+		if(r < 0 && errno == EAGAIN) break;
+		if(r <= 0) return -1;
+		state->bytes_in += r;
+		if(state->record) {
+			rec_write(&state->rec, 'o', buff, r);
+		}
+		vt_feed(state, buff, r);
+		state->changed = 1;
+		if(state->out.len - state->outpos >= OUTPUT_QUEUE_LIMIT) break;
+	}
+	return 0;
+}
+
 static int
 process_input(int master, PTYState *state)
 {
-	fd_set fd_in;
+	struct epoll_event ev, events[3];
+	Queue keys;
 	char buff[BUFFER_SIZE];
-	ParserState parser_state = NORMAL;
-	char csi_buff[CSI_BUFFER_SIZE];
-	int csi_index;
-	int params[MAX_PARAMS];
-	int param_count;
-	int param_val;
-	char private_param;
-	char intermediate;
-	char final_char;
-	int r;
-	unsigned int i, j;
-	char ch;
-	int handled;
-	int p;
-
-	csi_index = 0;
-	param_count = 0;
-	param_val = 0;
-	private_param = 0;
-	intermediate = 0;
-	final_char = 0;
-
-	while(1) {
-		FD_ZERO(&fd_in);
-		FD_SET(STDIN_FILENO, &fd_in);
-		FD_SET(master, &fd_in);
-		if(select(master + 1, &fd_in, NULL, NULL, NULL) < 0) {
-			perror("select " STR(__LINE__));
+	int fds[3];
+	unsigned int want[3], cur[3];
+	int polled[3];
+	int ep, n, i, k, ret, done, writable, timeout, late;
+	size_t pending, len;
+	long long wait, now;
+
+	/* Keys from stdin, output of the child, frames to stdout. Either
+	 * of the standard fds may be a file, which epoll refuses. */
+	fds[0] = STDIN_FILENO;
+	fds[1] = master;
+	fds[2] = state->outfd;
+	if((ep = epoll_create1(0)) < 0) {
+		perror("epoll_create1 " STR(__LINE__));
+		return 1;
+	}
+	for(i = 0; i < 3; ++i) {
+		ev.events = cur[i] = 0;
+		ev.data.u32 = i;
+		polled[i] = !epoll_ctl(ep, EPOLL_CTL_ADD, fds[i], &ev);
+		if(!polled[i] && errno != EPERM) {
+			perror("epoll_ctl " STR(__LINE__));
+			close(ep);
+			return 1;
+		}
+		if(polled[i] && set_nonblock(fds[i], 1)) {
+			close(ep);
 			return 1;
 		}
+	}
 
-		if(FD_ISSET(STDIN_FILENO, &fd_in)) {
-			r = read(STDIN_FILENO, buff, sizeof(buff));
-			if(r > 0) {
-				write(master, buff, r);
+	keys.start = keys.len = 0;
+	ret = done = 0;
+	while(!done) {
+		if(winched) {
+			winched = 0;
+			redraw_screen(state);
+		}
+		pending = state->frame_mark - state->outpos;
+		want[0] = (keys.len < sizeof(keys.data)) ? EPOLLIN : 0;
+		want[1] = (state->out.len - state->outpos < OUTPUT_QUEUE_LIMIT ? EPOLLIN : 0) |
+		          (keys.len ? EPOLLOUT : 0);
+		want[2] = pending ? EPOLLOUT : 0;
+		for(i = 0; i < 3; ++i) {
+			if(polled[i] && want[i] != cur[i]) {
+				ev.events = cur[i] = want[i];
+				ev.data.u32 = i;
+				epoll_ctl(ep, EPOLL_CTL_MOD, fds[i], &ev);
 			}
 		}
 
-		if(FD_ISSET(master, &fd_in)) {
-			r = read(master, buff, sizeof(buff));
-			if(r <= 0) break;
-
-			for(i = 0; i < r; ++i) {
-				ch = buff[i];
-				switch(parser_state) {
-				case NORMAL:
-					if(ch == 27) {
-						parser_state = ESC;
-					} else {
-						handle_normal_state(ch, state);
-					}
-					break;
-				case ESC:
-					switch(ch) {
-					case '[':
-						parser_state = CSI;
-						csi_index = 0;
-						memset(csi_buff, 0, sizeof(csi_buff));
-						param_count = 0;
-						param_val = 0;
-						private_param = 0;
-						intermediate = 0;
-						final_char = 0;
-						break;
-					case '7':
-						state->saved_vrow = state->vrow;
-						state->saved_vcol = state->vcol;
-						break;
-					case '8':
-						state->vrow = state->saved_vrow;
-						state->vcol = state->saved_vcol;
-						if(state->vrow < state->scroll_top) {
-							state->vrow = state->scroll_top;
-						}
-						if(state->vrow > state->scroll_bottom) {
-							state->vrow = state->scroll_bottom;
-						}
-
-						move_to_real(state->x, state->y, state->vrow, state->vcol);
-
-						break;
-					case 'D':
-						if(state->vrow < state->scroll_bottom) {
-							++state->vrow;
-						} else {
-							scroll_up_pty(state, 1);
-						}
-						
-						move_to_real(state->x, state->y, state->vrow, state->vcol);
-
-						break;
-					case 'M':
-						if(state->vrow > state->scroll_top) {
-							--state->vrow;
-						} else {
-							scroll_down_pty(state, 1);
-						}
-						
-						move_to_real(state->x, state->y, state->vrow, state->vcol);
-
-						break;
-					default:
-						printf("\033%c", ch);
-						fflush(stdout);
-					}
+		/* Sleep until the next frame is due, if one is waiting, or
+		 * the next tick of the rain. */
+		timeout = -1;
+		if(state->changed && pending == 0) {
+			wait = state->next_frame - now_us();
+			timeout = (wait > 0) ? (wait + 999) / 1000 : 0;
+		}
+		if(state->drops) {
+			wait = state->next_tick - now_us();
+			wait = (wait > 0) ? (wait + 999) / 1000 : 0;
+			timeout = (timeout < 0 || wait < timeout) ? wait : timeout;
+		}
 
-					if(ch != '[') {
-						parser_state = NORMAL;
-					}
+		if((n = epoll_wait(ep, events, 3, timeout)) < 0) {
+			if(errno == EINTR) continue;
+			perror("epoll_wait " STR(__LINE__));
+			ret = 1;
+			break;
+		}
 
-					break;
-				case CSI:
-					csi_buff[csi_index++] = ch;
-					if(ch >= '0' && ch <= '9') {
-						param_val *= 10;
-						param_val += ch - '0';
-					} else if(ch == ';') {
-						if(param_count < MAX_PARAMS) {
-							params[param_count++] = param_val;
-						}
-						param_val = 0;
-						break;
-					} else if(ch == '?') {
-						private_param = '?';
-						csi_buff[--csi_index] = 0;
-						break;
-					} else if(ch >= 0x30 && ch <= 0x3f) {
-						/* ignore */
-					} else if(ch >= 0x20 && ch <= 0x2f) {
-						intermediate = ch;
-					} else if(ch >= 0x40 && ch <= 0x7e) {
-						final_char = ch;
-						if(param_val || param_count == 0) {
-							params[param_count++] = param_val;
-						}
-						parser_state = NORMAL;
-
-						handled = 0;
-						if(private_param == 0 && intermediate == 0) {
-							handled = handle_csi_sequence(state, params, param_count, final_char);
-						}
-
-						if(private_param) {
-							p = (param_count > 0) ? params[0] : 0;
-							if(p == 47   || p == 1047 || p == 1048 || p == 1049 ||
-							   p == 1000 || p == 1001 || p == 1002 || p == 1003 ||
-							   p == 1004 || p == 1005 || p == 1006 || p == 1015 ||
-							   p == 1016 || p == 2004) {
-								/* ignore */
-							} else {
-								printf(ANSIESC "?");
-								if(param_count > 0) {
-									printf("%d", params[0]);
-									for(j = 1; j < param_count; ++j) {
-										printf(";%d", params[j]);
-									}
-								}
-								putchar(final_char);
-								fflush(stdout);
-							}
-						} else if(!handled) {
-							printf(ANSIESC);
-							if(param_count > 0) {
-								printf("%d", params[0]);
-								for(j = 1; j < param_count; ++j) {
-									printf(";%d", params[j]);
-								}
-							}
-							putchar(final_char);
-							fflush(stdout);
-						}
+		writable = 0;
+		for(k = 0; k < n; ++k) {
+			i = events[k].data.u32;
+			if(i == 0) {
+				len = keys.len;
+				if(keys.len < sizeof(keys.data) && queue_read(STDIN_FILENO, &keys) <= 0) {
+					/* Nothing more to type. */
+					epoll_ctl(ep, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+					polled[0] = 0;
+				}
+				if(state->late_until && keys.len > len) {
+					/* The probe's replies are no keys for the child. */
+					keys.len = len + probe_discard(keys.data + keys.start + len, keys.len - len, &late);
+					if(late || now_us() >= state->late_until) {
+						state->late_until = 0;
 					}
 				}
+				if(state->record && keys.len > len) {
+					rec_write(&state->rec, 'i', keys.data + keys.start + len, keys.len - len);
+				}
+			} else if(i == 1) {
+				if(events[k].events & EPOLLOUT && queue_write(master, &keys) < 0) {
+					keys.len = 0;
+				}
+				if(events[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR) && read_child(master, state, buff)) {
+					done = 1;
+				}
+			} else {
+				writable = 1;
 			}
 		}
+
+		if(writable && out_flush(state)) {
+			ret = 1;
+			break;
+		}
+
+		/* The rain moves on in the grid whether or not the terminal
+		 * keeps up, which then gets the difference, and ticks missed
+		 * while busy are not made up for. */
+		if(state->drops && (now = now_us()) >= state->next_tick) {
+			rain_tick(state);
+			state->next_tick += 1000000 / state->rain;
+			if(state->next_tick <= now) {
+				state->next_tick = now + 1000000 / state->rain;
+			}
+			state->changed = 1;
+		}
+
+		/* Draw only when the terminal has taken the last frame and the
+		 * frame interval is over. Until then changes pile up in the
+		 * grid and go out as one. After a quiet spell that is at once. */
+		if(state->changed && state->outpos == state->frame_mark && now_us() >= state->next_frame) {
+			present(state);
+			if(out_flush(state)) {
+				ret = 1;
+				break;
+			}
+		}
+	}
+
+	close(ep);
+	/* The last frame goes out whole. */
+	if(polled[2]) {
+		set_nonblock(state->outfd, 0);
 	}
+	if(!ret) {
+		present(state);
+		ret = out_flush(state);
+	}
+	return ret;
 }
 
+#ifndef PTY_SHELL_NO_MAIN
 int
 main(int argc, char *argv[])
 {
 	struct winsize ws;
+	struct sigaction sa;
 	PTYState state;
-	unsigned int i, j;
+	char typeahead[TYPEAHEAD_SIZE];
+	size_t ntypeahead;
 	int master;
 	pid_t pid;
 
@@ -965,21 +3214,10 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
-	state.vrow = state.vcol = state.saved_vrow = state.saved_vcol = 0;
-	state.wrap_pending = 0;
-	if(parse_arguments(argc, argv, &ws, &state)) {
-		exit(1);
-	}
-
-	state.buffer = (Cell **)malloc(state.h * sizeof(Cell *));
-	for(i = 0; i < state.h; ++i) {
-		state.buffer[i] = (Cell *)malloc(state.w * sizeof(Cell));
-		for(j = 0; j < state.w; ++j) {
-			reset_cell(state.buffer[i] + j);
-		}
-	}
-
-	if(initialize_pty(&state, &master, &pid, &ws)) {
+	enc_init();
+	vt_init();
+	init_state(&state);
+	if(parse_arguments(argc, argv, &ws, &state) || init_screen(&state)) {
 		exit(1);
 	}
 
@@ -993,19 +3231,72 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
-	printf(ANSIESC "?69h" ANSIESC "%d;%ds" ANSIESC "%d;%dr", state.x + 1, state.x + state.w, state.y + 1, state.y + state.h);
-	for(i = 0; i < state.h; ++i) {
-		redraw_line(&state, i, 0, state.w - 1);
+	/* Ask the terminal what it can do. Options turn off what it has,
+	 * never turn on what it lacks. */
+	ntypeahead = 0;
+	if(state.probe && !probe_terminal(STDIN_FILENO, STDOUT_FILENO, PROBE_TIMEOUT_MS, 0, &state.caps,
+	                                  typeahead, &ntypeahead, sizeof(typeahead)) &&
+	   isatty(STDIN_FILENO) && isatty(STDOUT_FILENO)) {
+		/* Too slow, the replies may still come. */
+		state.late_until = now_us() + PROBE_LATE_MS * 1000LL;
+	}
+	if(state.profile) {
+		tcsetattr(STDIN_FILENO, TCSANOW, &orig_termios);
+		probe_print(stdout, &state.caps);
+		exit(0);
+	}
+	state.margins &= state.caps.margins;
+	state.sync &= state.caps.sync;
+	if(state.rep_min == -1) {
+		state.rep_min = state.caps.rep ? DEF_REP_MIN : 0;
+	}
+	enc_truecolor(state.caps.truecolor);
+
+	if(state.replay ? start_replay(&state, &master, &pid) : initialize_pty(&state, &master, &pid, &ws)) {
+		exit(1);
 	}
-	move_to_real(state.x, state.y, state.vrow, state.vcol);
-	fflush(stdout);
+	if(state.record && rec_open(&state.rec, state.record, state.w, state.h)) {
+		exit(1);
+	}
+	if(ntypeahead && write(master, typeahead, ntypeahead) < 0) {
+		perror("write " STR(__LINE__));
+	}
+
+	send_margins(&state, state.cols, state.rows);
+	set_dirty_rows(&state, 0, state.h - 1);
+	present(&state);
+	out_flush(&state);
+
+	/* The region keeps its size, but a resize may have cleared or
+	 * reflowed the terminal, so it is drawn again. */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_winch;
+	sigaction(SIGWINCH, &sa, NULL);
 
 	process_input(master, &state);
+	if(state.record) {
+		rec_close(&state.rec);
+	}
+
+	if(state.stats) {
+		tcsetattr(STDIN_FILENO, TCSANOW, &orig_termios);
+		fprintf(stderr, "%llu bytes in, %llu bytes out (%.2f per input byte), %llu writes\n",
+		        state.bytes_in, state.bytes_out,
+		        state.bytes_in ? (double)state.bytes_out / state.bytes_in : 0.0,
+		        state.writes);
+	}
 
-	for(i = 0; i < state.h; ++i) {
-		free(state.buffer[i]);
+	grid_free(&state.buffer);
+	grid_free(&state.shown);
+	grid_free(&state.alt);
+	if(state.back.cells) {
+		grid_free(&state.back);
+		grid_free(&state.back_shown);
 	}
-	free(state.buffer);
+	free(state.drops);
+	attr_table_free(&state.attrs);
+	free(state.out.data);
 
 	return 0;
 }
+#endif
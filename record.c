@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "record.h"
+
+#define REC_CHUNK	(1 << 20)	/* The log grows by at least this. */
+#define REC_EVENT	64		/* Room for an event's time and type. */
+
+static const char hex[] = "0123456789abcdef";
+
+static long long rec_now(void);
+
+static int rec_reserve(Recorder *r, size_t n);
+
+static size_t utf8_valid(const unsigned char *s, size_t n);
+
+static int hexval(const char *s, int n);
+
+static int header_int(const char *s, size_t n, const char *key);
+
+static long long
+rec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int
+rec_reserve(Recorder *r, size_t n)
+{
+	size_t size;
+	char *map;
+
+	/* The file is as long as the mapping, and cut to what was
+	 * written when it is closed. */
+	if(r->len + n <= r->size) return 0;
+	size = r->size * 2;
+	if(size < r->len + n + REC_CHUNK) {
+		size = r->len + n + REC_CHUNK;
+	}
+	if(ftruncate(r->fd, size) < 0) {
+		perror("ftruncate");
+		return 1;
+	}
+	map = r->map ? mremap(r->map, r->size, size, MREMAP_MAYMOVE) :
+	      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+	if(map == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	r->map = map;
+	r->size = size;
+	return 0;
+}
+
+static size_t
+utf8_valid(const unsigned char *s, size_t n)
+{
+	size_t len, i;
+	unsigned char lo, hi;
+
+	/* Length of the well-formed sequence at s, 0 if there is none. */
+	lo = 0x80;
+	hi = 0xbf;
+	if(s[0] >= 0xc2 && s[0] <= 0xdf) {
+		len = 2;
+	} else if(s[0] >= 0xe0 && s[0] <= 0xef) {
+		len = 3;
+		lo = (s[0] == 0xe0) ? 0xa0 : lo;
+		hi = (s[0] == 0xed) ? 0x9f : hi;
+	} else if(s[0] >= 0xf0 && s[0] <= 0xf4) {
+		len = 4;
+		lo = (s[0] == 0xf0) ? 0x90 : lo;
+		hi = (s[0] == 0xf4) ? 0x8f : hi;
+	} else {
+		return 0;
+	}
+	if(len > n || s[1] < lo || s[1] > hi) return 0;
+	for(i = 2; i < len; ++i) {
+		if(s[i] < 0x80 || s[i] > 0xbf) return 0;
+	}
+	return len;
+}
+
+int
+rec_open(Recorder *r, const char *path, int width, int height)
+{
+	r->map = NULL;
+	r->len = r->size = 0;
+	if((r->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror(path);
+		return 1;
+	}
+	if(rec_reserve(r, REC_EVENT * 2)) {
+		close(r->fd);
+		return 1;
+	}
+	r->len = snprintf(r->map, REC_EVENT * 2,
+	                  "{\"version\": 2, \"width\": %d, \"height\": %d, \"timestamp\": %lld}\n",
+	                  width, height, (long long)time(NULL));
+	r->start = rec_now();
+	return 0;
+}
+
+void
+rec_write(Recorder *r, char type, const char *s, size_t n)
+{
+	const unsigned char *u = (const unsigned char *)s;
+	char *p;
+	size_t i, k;
+	long long t;
+
+	/* Six bytes is the most a byte takes escaped. */
+	if(rec_reserve(r, REC_EVENT + 6 * n)) return;
+	t = rec_now() - r->start;
+	p = r->map + r->len;
+	p += sprintf(p, "[%lld.%06lld, \"%c\", \"", t / 1000000, t % 1000000, type);
+	for(i = 0; i < n; ) {
+		if(u[i] >= 0x20 && u[i] < 0x7f && u[i] != '"' && u[i] != '\\') {
+			*p++ = u[i++];
+		} else if(u[i] == '"' || u[i] == '\\') {
+			*p++ = '\\';
+			*p++ = u[i++];
+		} else if(u[i] >= 0x80 && (k = utf8_valid(u + i, n - i))) {
+			memcpy(p, u + i, k);
+			p += k;
+			i += k;
+		} else {
+			memcpy(p, "\\u00", 4);
+			p[4] = hex[u[i] >> 4];
+			p[5] = hex[u[i] & 0xf];
+			p += 6;
+			++i;
+		}
+	}
+	memcpy(p, "\"]\n", 3);
+	r->len = p + 3 - r->map;
+}
+
+void
+rec_close(Recorder *r)
+{
+	if(r->map) {
+		munmap(r->map, r->size);
+	}
+	if(ftruncate(r->fd, r->len) < 0) {
+		perror("ftruncate");
+	}
+	close(r->fd);
+}
+
+static int
+hexval(const char *s, int n)
+{
+	int v, i, d;
+
+	for(v = i = 0; i < n; ++i) {
+		if(s[i] >= '0' && s[i] <= '9') d = s[i] - '0';
+		else if(s[i] >= 'a' && s[i] <= 'f') d = s[i] - 'a' + 10;
+		else if(s[i] >= 'A' && s[i] <= 'F') d = s[i] - 'A' + 10;
+		else return -1;
+		v = v * 16 + d;
+	}
+	return v;
+}
+
+static int
+header_int(const char *s, size_t n, const char *key)
+{
+	const char *p, *end;
+
+	/* The number after "key": in the header, -1 if it is not there. */
+	end = s + n;
+	if(!(p = memmem(s, n, key, strlen(key)))) return -1;
+	for(p += strlen(key); p < end && (*p == ' ' || *p == ':'); ++p);
+	return (p < end && *p >= '0' && *p <= '9') ? atoi(p) : -1;
+}
+
+int
+cast_open(Cast *c, const char *path)
+{
+	struct stat st;
+	const char *nl;
+	int fd;
+
+	memset(c, 0, sizeof(*c));
+	if((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		if(fd >= 0) close(fd);
+		return 1;
+	}
+	c->size = st.st_size;
+	c->map = c->size ? mmap(NULL, c->size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+	if(c->map == MAP_FAILED || !c->size) {
+		fprintf(stderr, "%s: Cannot map the recording.\n", path);
+		c->map = NULL;
+		return 1;
+	}
+	c->end = c->map + c->size;
+	if(!(nl = memchr(c->map, '\n', c->size)) || c->map[0] != '{' ||
+	   header_int(c->map, nl - c->map, "\"version\"") != 2) {
+		fprintf(stderr, "%s: Not an asciicast v2 recording.\n", path);
+		cast_close(c);
+		return 1;
+	}
+	c->width = header_int(c->map, nl - c->map, "\"width\"");
+	c->height = header_int(c->map, nl - c->map, "\"height\"");
+	c->width = (c->width < 0) ? 0 : c->width;
+	c->height = (c->height < 0) ? 0 : c->height;
+	c->p = nl + 1;
+	return 0;
+}
+
+int
+cast_next(Cast *c, double *t, char *type, size_t *n)
+{
+	const char *p, *nl;
+	char *out;
+	int v, lo;
+
+	/* Lines that are not events are skipped. Returns 0 at the end. */
+	for(; c->p < c->end; c->p = nl + 1) {
+		if(!(nl = memchr(c->p, '\n', c->end - c->p))) {
+			nl = c->end;
+		}
+		if(c->bufsize < (size_t)(nl - c->p)) {
+			c->bufsize = nl - c->p;
+			if(!(c->buf = realloc(c->buf, c->bufsize))) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		p = c->p;
+		if(*p++ != '[') continue;
+		*t = strtod(p, (char **)&p);
+		if(!(p = memchr(p, '"', nl - p)) || nl - p < 4 || p[2] != '"') continue;
+		*type = p[1];
+		if(!(p = memchr(p + 3, '"', nl - p - 3))) continue;
+
+		/* The string, unescaped, up to its closing quote. */
+		out = c->buf;
+		for(++p; p < nl && *p != '"'; ) {
+			if(*p != '\\' || p + 1 >= nl) {
+				*out++ = *p++;
+				continue;
+			}
+			switch(p[1]) {
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			case 'b': *out++ = '\b'; break;
+			case 'f': *out++ = '\f'; break;
+			case 'u':
+				if(nl - p < 6 || (v = hexval(p + 2, 4)) < 0) {
+					v = 0xfffd;
+				} else if(v >= 0xd800 && v < 0xdc00 && nl - p >= 12 && p[6] == '\\' &&
+				          p[7] == 'u' && (lo = hexval(p + 8, 4)) >= 0xdc00 && lo < 0xe000) {
+					v = 0x10000 + ((v - 0xd800) << 10) + lo - 0xdc00;
+					p += 6;
+				}
+				if(v < 0x100) {
+					/* Our escape for a byte, or a control. */
+					*out++ = v;
+				} else if(v < 0x800) {
+					*out++ = 0xc0 | v >> 6;
+					*out++ = 0x80 | (v & 0x3f);
+				} else if(v < 0x10000) {
+					*out++ = 0xe0 | v >> 12;
+					*out++ = 0x80 | (v >> 6 & 0x3f);
+					*out++ = 0x80 | (v & 0x3f);
+				} else {
+					*out++ = 0xf0 | v >> 18;
+					*out++ = 0x80 | (v >> 12 & 0x3f);
+					*out++ = 0x80 | (v >> 6 & 0x3f);
+					*out++ = 0x80 | (v & 0x3f);
+				}
+				p += 4;
+				break;
+			default: *out++ = p[1];
+			}
+			p += 2;
+		}
+		*n = out - c->buf;
+		c->p = (nl < c->end) ? nl + 1 : nl;
+		return 1;
+	}
+	return 0;
+}
+
+void
+cast_close(Cast *c)
+{
+	if(c->map) {
+		munmap(c->map, c->size);
+	}
+	free(c->buf);
+	c->map = NULL;
+	c->buf = NULL;
+}
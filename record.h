@@ -0,0 +1,39 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stddef.h>
+
+/* Sessions in asciicast v2: a JSON header line, then one line per read
+ * as [seconds, "o" or "i", "data"]. Bytes that are not UTF-8 are kept
+ * as \u0080 to \u00ff escapes, which only our reader takes back to the
+ * bytes they were. */
+
+typedef struct {
+	int fd;
+	char *map;			/* The file, mapped as it grows, */
+	size_t len, size;		/* of which this much is written. */
+	long long start;		/* Time of the header, in us. */
+} Recorder;
+
+typedef struct {
+	char *map;
+	size_t size;
+	const char *p, *end;		/* Next line, end of the file. */
+	int width, height;		/* From the header, 0 if not given. */
+	char *buf;			/* The last event's data. */
+	size_t bufsize;
+} Cast;
+
+int rec_open(Recorder *r, const char *path, int width, int height);
+
+void rec_write(Recorder *r, char type, const char *s, size_t n);
+
+void rec_close(Recorder *r);
+
+int cast_open(Cast *c, const char *path);
+
+int cast_next(Cast *c, double *t, char *type, size_t *n);
+
+void cast_close(Cast *c);
+
+#endif
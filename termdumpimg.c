@@ -0,0 +1,334 @@
+/*
+ * Draws a PNG on the terminal with sixel or kitty graphics, placed and
+ * sized in pixels of the terminal's own cells.
+ *
+ * What is drawn is kept in $XDG_CACHE_HOME/tmux-undercover, one file
+ * for each image, its mtime, the geometry and the format, holding the
+ * key on its first line and the escapes to write after it. A later run
+ * that finds it maps it and writes it out, with no PNG to decode.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "encode.h"
+#include "img.h"
+#include "probe.h"
+
+#define FONTW		6	/* Cell size when the terminal does not say. */
+#define FONTH		12
+#define TYPEAHEAD_SIZE	256
+#define CACHE_DIR	"tmux-undercover"
+#define KEY_SIZE	(PATH_MAX + 256)
+
+enum { FMT_AUTO, FMT_SIXEL, FMT_KITTY };
+
+static void usage(const char *name);
+
+static int probe_format(void);
+
+static int write_all(int fd, const char *s, size_t n);
+
+static int cache_path(char *path, size_t size, const char *key);
+
+static int cache_hit(const char *path, const char *key);
+
+static void cache_store(const char *path, const char *key, const OutBuf *out);
+
+static const char *formats[] = { "auto", "sixel", "kitty" };
+
+static void
+usage(const char *name)
+{
+	printf("Usage: %s [-x X_POS] [-y Y_POS] [-w WIDTH] [-h HEIGHT] [-s] [-m] [-o FORMAT] [-n] <image_path>\n"
+	       "Options:\n"
+	       "  -x X_POS   X position of top-left corner (positive: from left, negative: from right, default: 0)\n"
+	       "  -y Y_POS   Y position of top-left corner (positive: from top, negative: from bottom, default: 0)\n"
+	       "  -w WIDTH   Display width in pixels (positive: absolute, negative: from terminal width)\n"
+	       "  -h HEIGHT  Display height in pixels (positive: absolute, negative: from terminal height)\n"
+	       "  -s         Allow stretching if exceeding terminal dimensions\n"
+	       "  -m         Prevent the image from being moved to fit in the terminal, if it would be rendered outside\n"
+	       "  -o FORMAT  sixel or kitty (default: asks the terminal, sixel if it does not know kitty's)\n"
+	       "  -n         Do not use the cache\n",
+	       name);
+	exit(1);
+}
+
+static int
+probe_format(void)
+{
+	struct termios orig, raw;
+	char typeahead[TYPEAHEAD_SIZE];
+	size_t n;
+	Caps caps;
+
+	/* Keys typed while the terminal answers are lost. */
+	if(!isatty(STDIN_FILENO) || tcgetattr(STDIN_FILENO, &orig) < 0) {
+		return FMT_SIXEL;
+	}
+	raw = orig;
+	raw.c_lflag &= ~(ICANON | ECHO);
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+	probe_terminal(STDIN_FILENO, STDOUT_FILENO, PROBE_TIMEOUT_MS, 1, &caps, typeahead, &n, sizeof(typeahead));
+	tcsetattr(STDIN_FILENO, TCSANOW, &orig);
+	return (caps.kitty > 0) ? FMT_KITTY : FMT_SIXEL;
+}
+
+static int
+write_all(int fd, const char *s, size_t n)
+{
+	ssize_t r;
+
+	while(n) {
+		if((r = write(fd, s, n)) < 0) {
+			if(errno == EINTR) continue;
+			perror("write");
+			return 1;
+		}
+		s += r;
+		n -= r;
+	}
+	return 0;
+}
+
+static int
+cache_path(char *path, size_t size, const char *key)
+{
+	const char *base, *home;
+	unsigned long long hash;
+	size_t len;
+
+	/* The directory is made as needed, and the name is a hash of the
+	 * key, which the file repeats in case two keys hash alike. */
+	if((base = getenv("XDG_CACHE_HOME")) && *base) {
+		len = snprintf(path, size, "%s", base);
+	} else if((home = getenv("HOME")) && *home) {
+		len = snprintf(path, size, "%s/.cache", home);
+		mkdir(path, 0700);
+	} else {
+		return 1;
+	}
+	if(len + sizeof(CACHE_DIR) + 20 > size) return 1;
+	len += snprintf(path + len, size - len, "/" CACHE_DIR);
+	if(mkdir(path, 0700) < 0 && errno != EEXIST) return 1;
+	for(hash = 14695981039346656037ULL; *key; ++key) {
+		hash = (hash ^ (unsigned char)*key) * 1099511628211ULL;
+	}
+	snprintf(path + len, size - len, "/%016llx", hash);
+	return 0;
+}
+
+static int
+cache_hit(const char *path, const char *key)
+{
+	struct stat st;
+	size_t len;
+	char *map;
+	int cfd, hit;
+
+	if((cfd = open(path, O_RDONLY)) < 0) return 0;
+	len = strlen(key);
+	if(fstat(cfd, &st) < 0 || (size_t)st.st_size <= len ||
+	   (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, cfd, 0)) == MAP_FAILED) {
+		close(cfd);
+		return 0;
+	}
+	close(cfd);
+	hit = !memcmp(map, key, len) && map[len] == '\n';
+	if(hit && write_all(STDOUT_FILENO, map + len + 1, st.st_size - len - 1)) {
+		exit(1);
+	}
+	munmap(map, st.st_size);
+	return hit;
+}
+
+static void
+cache_store(const char *path, const char *key, const OutBuf *out)
+{
+	char tmp[PATH_MAX + 8];
+	int fd;
+
+	/* Written aside and renamed, so that no run maps half a file. */
+	if(snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp) ||
+	   (fd = mkstemp(tmp)) < 0) {
+		return;
+	}
+	if(write_all(fd, key, strlen(key)) || write_all(fd, "\n", 1) ||
+	   write_all(fd, out->data, out->len) || close(fd) < 0 || rename(tmp, path) < 0) {
+		unlink(tmp);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct winsize ws;
+	struct stat st;
+	Image img, scaled;
+	OutBuf out;
+	char real[PATH_MAX], key[KEY_SIZE], path[PATH_MAX];
+	int opt, x, y, w, h, wset, hset, noscale, nomove, format;
+	int cw, ch, termw, termh, ow, oh, cache;
+
+	x = y = w = h = wset = hset = noscale = nomove = 0;
+	cache = 1;
+	format = FMT_AUTO;
+	while((opt = getopt(argc, argv, "x:y:w:h:smo:n")) != -1) {
+		switch(opt) {
+		case 'x':
+			x = atoi(optarg);
+			break;
+		case 'y':
+			y = atoi(optarg);
+			break;
+		case 'w':
+			w = atoi(optarg);
+			wset = 1;
+			break;
+		case 'h':
+			h = atoi(optarg);
+			hset = 1;
+			break;
+		case 's':
+			noscale = 1;
+			break;
+		case 'm':
+			nomove = 1;
+			break;
+		case 'o':
+			if(!strcmp(optarg, "sixel")) {
+				format = FMT_SIXEL;
+			} else if(!strcmp(optarg, "kitty")) {
+				format = FMT_KITTY;
+			} else {
+				usage(*argv);
+			}
+			break;
+		case 'n':
+			cache = 0;
+			break;
+		default:
+			usage(*argv);
+		}
+	}
+	if(optind >= argc) {
+		usage(*argv);
+	}
+
+	/* The terminal's size in pixels, from the cell size it reports. */
+	if(ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) < 0 || !ws.ws_col || !ws.ws_row) {
+		ws.ws_col = 80;
+		ws.ws_row = 24;
+		ws.ws_xpixel = ws.ws_ypixel = 0;
+	}
+	cw = ws.ws_xpixel / ws.ws_col;
+	ch = ws.ws_ypixel / ws.ws_row;
+	cw = cw ? cw : FONTW;
+	ch = ch ? ch : FONTH;
+	termw = cw * ws.ws_col;
+	termh = ch * ws.ws_row;
+
+	ow = oh = 0;
+	if((!wset || !hset) && img_size(argv[optind], &ow, &oh)) {
+		return 1;
+	}
+	if(x < 0) {
+		x = (termw + x < 0) ? 0 : termw + x;
+	}
+	if(y < 0) {
+		y = (termh + y < 0) ? 0 : termh + y;
+	}
+	if(!wset) {
+		w = ow;
+	} else if(w <= 0) {
+		w = (termw + w < 0) ? 0 : termw + w;
+	}
+	if(!hset) {
+		h = oh;
+	} else if(h <= 0) {
+		h = (termh + h < 0) ? 0 : termh + h;
+	}
+	if(!noscale) {
+		if(w > termw) {
+			h = (long long)h * termw / w;
+			w = termw;
+		}
+		if(h > termh) {
+			w = (long long)w * termh / h;
+			h = termh;
+		}
+	}
+	if(!nomove) {
+		if(x + w > termw) {
+			x = (termw - w < 0) ? 0 : termw - w;
+		}
+		if(y + h > termh) {
+			y = (termh - h < 0) ? 0 : termh - h;
+		}
+	}
+	if(w <= 0 || h <= 0 || x >= termw || y >= termh) {
+		return 0;
+	}
+
+	if(format == FMT_AUTO) {
+		format = probe_format();
+	}
+	if(cache && realpath(argv[optind], real) && !stat(real, &st)) {
+		snprintf(key, sizeof(key), "%s %lld.%09ld %lld %s %d %d %d %d %d %d %d %d", real,
+		         (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, (long long)st.st_size,
+		         formats[format], x, y, w, h, cw, ch, termw, termh);
+		cache = !cache_path(path, sizeof(path), key);
+		if(cache && cache_hit(path, key)) {
+			return 0;
+		}
+	} else {
+		cache = 0;
+	}
+
+	if(img_load(&img, argv[optind])) {
+		return 1;
+	}
+	if(img.w != w || img.h != h) {
+		if(img_scale(&scaled, &img, w, h)) {
+			return 1;
+		}
+		img_free(&img);
+		img = scaled;
+	}
+
+	/* Sixels start at a cell, and only what is on the terminal is sent.
+	 * With ?8452 the cursor stays beside a sixel image, so that one
+	 * ending on the last row does not scroll. */
+	memset(&out, 0, sizeof(out));
+	out_str(&out, "\0337");
+	if(format == FMT_SIXEL) {
+		out_str(&out, "\033[?8452h");
+	}
+	enc_csi2(&out, y / ch + 1, x / cw + 1, 'H');
+	if(format == FMT_SIXEL) {
+		img_sixel(&out, &img, termw - x / cw * cw, termh - y / ch * ch);
+		out_str(&out, "\033[?8452l");
+	} else {
+		img_kitty(&out, &img, termw - x, termh - y, x % cw, y % ch);
+	}
+	out_str(&out, "\0338");
+	if(cache) {
+		cache_store(path, key, &out);
+	}
+	if(write_all(STDOUT_FILENO, out.data, out.len)) {
+		return 1;
+	}
+	img_free(&img);
+	free(out.data);
+	return 0;
+}
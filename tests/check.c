@@ -0,0 +1,185 @@
+/*
+ * Headless checks of what pty-shell sends the outer terminal, for cases
+ * where the output looks right to the renderer and wrong on a screen.
+ * Each feeds a stream through the parser and presents a frame, with the
+ * terminal replaced by the output buffer.
+ */
+#define _GNU_SOURCE
+#define PTY_SHELL_NO_MAIN
+#include "pty-shell.c"
+
+#define COLS		80
+#define ROWS		24
+
+static int failed;
+
+static void check(int ok, const char *what);
+
+static void setup(PTYState *state);
+
+static void teardown(PTYState *state);
+
+static void check_rep_ascii(void);
+
+static void check_wrap_compact(void);
+
+static void check_forward_framed(void);
+
+static void
+check(int ok, const char *what)
+{
+	printf("%-4s %s\n", ok ? "ok" : "FAIL", what);
+	failed += !ok;
+}
+
+static void
+setup(PTYState *state)
+{
+	init_state(state);
+	state->x = 4;
+	state->y = 2;
+	state->w = COLS - 8;
+	state->h = ROWS - 4;
+	state->cols = state->clip_cols = COLS;
+	state->rows = state->clip_rows = ROWS;
+	state->fps = 0;
+	if(init_screen(state)) {
+		exit(1);
+	}
+}
+
+static void
+teardown(PTYState *state)
+{
+	grid_free(&state->buffer);
+	grid_free(&state->shown);
+	grid_free(&state->alt);
+	attr_table_free(&state->attrs);
+	free(state->out.data);
+}
+
+static void
+check_rep_ascii(void)
+{
+	static const char s[] = "xxxxxxxxxxxxxxxxxxxxxxxx\r\n"
+	                        "\342\224\200\342\224\200\342\224\200\342\224\200\342\224\200"
+	                        "\342\224\200\342\224\200\342\224\200\342\224\200\342\224\200\r\n";
+	PTYState state;
+	const char *p, *q, *end;
+	int ascii, other;
+
+	/* Runs of box drawing go out whole, and REP only after ASCII. */
+	setup(&state);
+	state.rep_min = DEF_REP_MIN;
+	vt_feed(&state, s, sizeof(s) - 1);
+	present(&state);
+	ascii = other = 0;
+	end = state.out.data + state.out.len;
+	for(p = state.out.data + 1; p + 1 < end; ++p) {
+		if(p[0] != '\033' || p[1] != '[') continue;
+		for(q = p + 2; q < end && *q >= '0' && *q <= '9'; ++q);
+		if(q == end || *q != 'b') continue;
+		if((unsigned char)p[-1] < 0x80) {
+			++ascii;
+		} else {
+			++other;
+		}
+	}
+	check(ascii > 0, "REP sends a run of ASCII");
+	check(other == 0, "REP never follows a character outside ASCII");
+	check(memmem(state.out.data, state.out.len, "\342\224\200\342\224\200\342\224\200\342\224\200"
+	             "\342\224\200\342\224\200\342\224\200\342\224\200\342\224\200\342\224\200", 30) != NULL,
+	      "a run outside ASCII goes out character by character");
+	teardown(&state);
+}
+
+static void
+check_wrap_compact(void)
+{
+	static const Attr want = { 1, COLOR_RGB | 0x123456, 0 };
+	PTYState state;
+	char s[256];
+	Cell *cell;
+	Attr a;
+	int i, n;
+
+	/* Text that wraps at the bottom, in the attribute that fills the
+	 * table. The scroll interns the erased line's attribute, which
+	 * compacts the table in the middle of the run. */
+	setup(&state);
+	a.bg = -1;
+	a.attr = 0;
+	for(i = 0; state.attrs.n < ATTR_MAX - 1; ++i) {
+		a.fg = COLOR_RGB | i;
+		attr_lookup(&state.attrs, a);
+	}
+	n = snprintf(s, sizeof(s), "\033[31;48;2;18;52;86m\033[%d;1H", state.h);
+	for(i = 0; i < state.w; ++i) {
+		s[n++] = 'x';
+	}
+	s[n++] = 'a';
+	s[n++] = 'b';
+	vt_feed(&state, s, n);
+	cell = grid_row(&state.buffer, state.h - 1);
+	check(state.attrs.n < ATTR_MAX, "a full table is compacted by a scroll");
+	check(cell[0].ch == 'a' && cell[0].attr < state.attrs.n &&
+	      !memcmp(&state.attrs.attrs[cell[0].attr], &want, sizeof(Attr)),
+	      "text after the scroll keeps its attribute");
+	teardown(&state);
+}
+
+static void
+check_forward_framed(void)
+{
+	PTYState state;
+	char buf[4096];
+	ssize_t n;
+	int fd[2];
+
+	/* At full width in lockstep, the child's text is queued as it is
+	 * parsed. It waits for the frame, not for the terminal. */
+	if(pipe(fd) || set_nonblock(fd[0], 1)) {
+		exit(1);
+	}
+	setup(&state);
+	state.x = 0;
+	state.w = COLS;
+	state.right_edge = state.full_width = 1;
+	state.outfd = fd[1];
+	grid_free(&state.buffer);
+	grid_free(&state.shown);
+	grid_free(&state.alt);
+	attr_table_free(&state.attrs);
+	if(init_screen(&state)) {
+		exit(1);
+	}
+	set_dirty_rows(&state, 0, state.h - 1);
+	present(&state);
+	out_flush(&state);
+	while(read(fd[0], buf, sizeof(buf)) > 0);
+	check(state.lockstep, "a full width region goes into lockstep");
+	vt_feed(&state, "hello\r\n", 7);
+	out_flush(&state);
+	check(read(fd[0], buf, sizeof(buf)) < 0, "forwarded text is held back until a frame");
+	present(&state);
+	out_flush(&state);
+	n = read(fd[0], buf, sizeof(buf) - 1);
+	buf[n > 0 ? n : 0] = '\0';
+	check(n > 0 && !strncmp(buf, ANSISYNCBEGIN, sizeof(ANSISYNCBEGIN) - 1) && strstr(buf, "hello") &&
+	      !strcmp(buf + n - (sizeof(ANSISYNCEND) - 1), ANSISYNCEND),
+	      "forwarded text goes out inside the frame's brackets");
+	teardown(&state);
+	close(fd[0]);
+	close(fd[1]);
+}
+
+int
+main(void)
+{
+	enc_init();
+	vt_init();
+	check_rep_ascii();
+	check_wrap_compact();
+	check_forward_framed();
+	return failed != 0;
+}
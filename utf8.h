@@ -0,0 +1,37 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stdint.h>
+
+#define UTF8_REPLACEMENT	0xfffd
+
+/* Columns taken by a codepoint: 0 for combining marks, 2 for wide
+ * characters, -1 for controls. */
+int utf8_width(uint32_t cp);
+
+static inline int
+utf8_encode(char *p, uint32_t cp)
+{
+	if(cp < 0x80) {
+		p[0] = cp;
+		return 1;
+	}
+	if(cp < 0x800) {
+		p[0] = 0xc0 | cp >> 6;
+		p[1] = 0x80 | (cp & 0x3f);
+		return 2;
+	}
+	if(cp < 0x10000) {
+		p[0] = 0xe0 | cp >> 12;
+		p[1] = 0x80 | (cp >> 6 & 0x3f);
+		p[2] = 0x80 | (cp & 0x3f);
+		return 3;
+	}
+	p[0] = 0xf0 | cp >> 18;
+	p[1] = 0x80 | (cp >> 12 & 0x3f);
+	p[2] = 0x80 | (cp >> 6 & 0x3f);
+	p[3] = 0x80 | (cp & 0x3f);
+	return 4;
+}
+
+#endif